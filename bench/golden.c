@@ -0,0 +1,242 @@
+// Render a fixed set of scenes without a window and compare them with the
+// reference images checked in under bench/golden_images, to check that a
+// change to the rasterizers keeps the output the same. 'make golden' runs the
+// comparison, and a change meant to alter the output records new references:
+//
+//   ./bench/golden compare ./bench/golden_images [-tolerance N] [-max-pixels N]
+//   ./bench/golden record ./bench/golden_images
+//
+// A pixel differs when one of its channels is off by more than the tolerance.
+// A scene fails when more than max-pixels pixels differ, and then a diff
+// image is written next to its reference, with the differing pixels in red
+// over a dimmed copy of the reference
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "display.h"
+#include "mesh.h"
+#include "pipeline.h"
+#include "texture.h"
+#include "texture_cache.h"
+
+#define WIDTH 320
+#define HEIGHT 240
+#define DEFAULT_TOLERANCE 2
+#define DEFAULT_MAX_PIXELS 0
+
+typedef struct {
+  const char *name;
+  const char *mesh;
+  float rotation_x;
+  float rotation_y;
+  enum render_method render_method;
+  enum texture_filter filter;
+  enum cull_method cull;
+} scene_t;
+
+static const scene_t scenes[] = {
+    {"crab_wire", "crab", 0, 0.5, RENDER_WIRE_VERTEX, FILTER_NEAREST,
+     CULL_NONE},
+    {"crab_fill", "crab", 0, 0.5, RENDER_FILL_TRIANGLE, FILTER_NEAREST,
+     CULL_BACKFACE},
+    {"crab_texture_nearest", "crab", 0, 0.5, RENDER_TEXTURE, FILTER_NEAREST,
+     CULL_BACKFACE},
+    {"crab_texture_bilinear", "crab", 0, 2.0, RENDER_TEXTURE, FILTER_BILINEAR,
+     CULL_BACKFACE},
+    {"crab_texture_trilinear", "crab", 0.3, 4.0, RENDER_TEXTURE,
+     FILTER_TRILINEAR, CULL_BACKFACE},
+    {"crab_texture_prepass", "crab", 0, 0.5, RENDER_TEXTURE_PREPASS,
+     FILTER_NEAREST, CULL_NONE},
+    {"f22_texture_wire", "f22", 0.5, 1.0, RENDER_TEXTURE_WIRE, FILTER_NEAREST,
+     CULL_BACKFACE},
+    {"drone_texture_nearest", "drone", 0.2, 3.0, RENDER_TEXTURE,
+     FILTER_NEAREST, CULL_NONE},
+    {"cube_texture_bilinear", "cube", 0.6, 0.8, RENDER_TEXTURE,
+     FILTER_BILINEAR, CULL_BACKFACE},
+    {"cube_fill_wire", "cube", 0.6, 0.8, RENDER_FILL_TRIANGLE_WIRE,
+     FILTER_NEAREST, CULL_BACKFACE},
+};
+#define NUM_SCENES (int)(sizeof(scenes) / sizeof(scenes[0]))
+
+// Render a scene into the color buffer, which holds it until pipeline_clear
+bool render_scene(const scene_t *scene) {
+  char filename[256];
+  mesh_t scene_mesh = {.scale = {1, 1, 1}};
+  scene_mesh.rotation.x = scene->rotation_x;
+  scene_mesh.rotation.y = scene->rotation_y;
+  scene_mesh.translation.z = 5.0;
+
+  snprintf(filename, sizeof(filename), "./assets/%s.obj", scene->mesh);
+  if (!load_obj_file_data(&scene_mesh, filename)) {
+    fprintf(stderr, "Error loading %s.\n", filename);
+    return false;
+  }
+  snprintf(filename, sizeof(filename), "./assets/%s.png", scene->mesh);
+  scene_mesh.texture = texture_cache_acquire(filename);
+
+  render_method = scene->render_method;
+  texture_filter = scene->filter;
+  cull_method = scene->cull;
+  pipeline_build_frame(&scene_mesh);
+  pipeline_rasterize();
+
+  array_free(scene_mesh.vertices);
+  array_free(scene_mesh.faces);
+  texture_cache_release(scene_mesh.texture);
+  return true;
+}
+
+bool write_ppm(const char *filename, const uint32_t *pixels, int width,
+               int height) {
+  FILE *file = fopen(filename, "wb");
+  if (file == NULL) return false;
+
+  fprintf(file, "P6\n%d %d\n255\n", width, height);
+  for (int i = 0; i < width * height; i++) {
+    unsigned char rgb[3] = {(pixels[i] >> 16) & 0xFF, (pixels[i] >> 8) & 0xFF,
+                            pixels[i] & 0xFF};
+    fwrite(rgb, 1, 3, file);
+  }
+  return fclose(file) == 0;
+}
+
+// Read a binary PPM written by write_ppm into opaque ARGB pixels
+uint32_t *read_ppm(const char *filename, int *width, int *height) {
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) return NULL;
+
+  int max_value = 0;
+  uint32_t *pixels = NULL;
+  if (fscanf(file, "P6 %d %d %d", width, height, &max_value) == 3 &&
+      max_value == 255 && *width > 0 && *height > 0 && fgetc(file) != EOF) {
+    pixels = (uint32_t *)malloc(sizeof(uint32_t) * *width * *height);
+  }
+
+  for (int i = 0; pixels && i < *width * *height; i++) {
+    unsigned char rgb[3];
+    if (fread(rgb, 1, 3, file) != 3) {
+      free(pixels);
+      pixels = NULL;
+      break;
+    }
+    pixels[i] = 0xFF000000 | rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+  }
+
+  fclose(file);
+  return pixels;
+}
+
+// Largest difference between the channels of two pixels
+int channel_delta(uint32_t a, uint32_t b) {
+  int delta = 0;
+  for (int shift = 0; shift < 24; shift += 8) {
+    int d = abs((int)((a >> shift) & 0xFF) - (int)((b >> shift) & 0xFF));
+    if (d > delta) delta = d;
+  }
+  return delta;
+}
+
+// Compare the rendered scene in the color buffer with its reference. Returns
+// true if it matches, writing a diff image otherwise
+bool compare_scene(const scene_t *scene, const char *directory, int tolerance,
+                   int max_pixels) {
+  char filename[512];
+  snprintf(filename, sizeof(filename), "%s/%s.ppm", directory, scene->name);
+
+  int width = 0;
+  int height = 0;
+  uint32_t *reference = read_ppm(filename, &width, &height);
+  if (reference == NULL || width != WIDTH || height != HEIGHT) {
+    printf("%-24s missing or invalid reference %s\n", scene->name, filename);
+    free(reference);
+    return false;
+  }
+
+  int differing = 0;
+  int max_delta = 0;
+  uint32_t *diff = (uint32_t *)malloc(sizeof(uint32_t) * WIDTH * HEIGHT);
+  for (int i = 0; i < WIDTH * HEIGHT; i++) {
+    int delta = channel_delta(color_buffer[i], reference[i]);
+    if (delta > max_delta) max_delta = delta;
+
+    if (delta > tolerance) {
+      differing++;
+      if (diff) diff[i] = 0xFFFF0000;
+    } else if (diff) {
+      diff[i] = 0xFF000000 | ((reference[i] >> 2) & 0x3F3F3F);
+    }
+  }
+
+  bool matches = differing <= max_pixels;
+  printf("%-24s %s  differing pixels: %d, max channel delta: %d\n",
+         scene->name, matches ? "ok  " : "FAIL", differing, max_delta);
+
+  if (!matches && diff) {
+    snprintf(filename, sizeof(filename), "%s/%s.diff.ppm", directory,
+             scene->name);
+    if (!write_ppm(filename, diff, WIDTH, HEIGHT)) {
+      fprintf(stderr, "Error writing %s.\n", filename);
+    }
+  }
+
+  free(diff);
+  free(reference);
+  return matches;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 ||
+      (strcmp(argv[1], "record") != 0 && strcmp(argv[1], "compare") != 0)) {
+    fprintf(stderr,
+            "usage: %s record|compare <directory> [-tolerance N] "
+            "[-max-pixels N]\n",
+            argv[0]);
+    return 2;
+  }
+  bool record = strcmp(argv[1], "record") == 0;
+  const char *directory = argv[2];
+
+  int tolerance = DEFAULT_TOLERANCE;
+  int max_pixels = DEFAULT_MAX_PIXELS;
+  for (int i = 3; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-tolerance") == 0) tolerance = atoi(argv[i + 1]);
+    if (strcmp(argv[i], "-max-pixels") == 0) max_pixels = atoi(argv[i + 1]);
+  }
+
+  // The references guard the uncompressed textures the renderer uses by
+  // default, whatever the default of compress_textures becomes
+  compress_textures = false;
+  texture_cache_init(TEXTURE_CACHE_DEFAULT_BUDGET);
+  if (!pipeline_init(WIDTH, HEIGHT)) {
+    fprintf(stderr, "Error allocating the frame.\n");
+    return 2;
+  }
+
+  int failures = 0;
+  for (int i = 0; i < NUM_SCENES; i++) {
+    if (!render_scene(&scenes[i])) return 2;
+
+    if (record) {
+      char filename[512];
+      snprintf(filename, sizeof(filename), "%s/%s.ppm", directory,
+               scenes[i].name);
+      if (!write_ppm(filename, color_buffer, WIDTH, HEIGHT)) {
+        fprintf(stderr, "Error writing %s.\n", filename);
+        return 2;
+      }
+      printf("%-24s recorded %s\n", scenes[i].name, filename);
+    } else if (!compare_scene(&scenes[i], directory, tolerance, max_pixels)) {
+      failures++;
+    }
+
+    pipeline_clear();
+  }
+
+  pipeline_free();
+  texture_cache_free();
+
+  if (!record) printf("%d of %d scenes differ\n", failures, NUM_SCENES);
+  return failures > 0 ? 1 : 0;
+}
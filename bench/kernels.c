@@ -0,0 +1,341 @@
+// Time the math, rasterization and decode kernels one at a time, so a change
+// to one of them can be measured without the rest of the frame around it.
+// Every kernel runs with twice as many operations until it takes long enough
+// to time, and reports the time per operation and, for the kernels that
+// write pixels, the pixels written per second:
+//
+//   ./bench/kernels [name prefix...]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "display.h"
+#include "file.h"
+#include "matrix.h"
+#include "pipeline.h"
+#include "texture.h"
+#include "triangle.h"
+#include "upng.h"
+#include "vector.h"
+
+#define MIN_SECONDS 0.25
+#define SCREEN_WIDTH 1024
+#define SCREEN_HEIGHT 768
+
+// Inputs of the math kernels, cycled through so the compiler can not hoist
+// the work out of the loops
+#define NUM_INPUTS 1024
+
+// Triangles drawn between two clears of the z-buffer, each nearer than the
+// previous one so all their pixels pass the depth test and are shaded
+#define TRIANGLE_BATCH 256
+
+#define TEXTURE_FILE "./assets/crab.png"
+
+typedef struct {
+  const char *name;
+  // Run the kernel ops times, returning the seconds taken and adding the
+  // pixels written to pixels
+  double (*run)(int param, long ops, unsigned long *pixels);
+  int param;
+} kernel_t;
+
+static vec4_t input_vectors[NUM_INPUTS];
+static mat4_t input_matrices[NUM_INPUTS];
+static vec2_t input_points[NUM_INPUTS];
+
+static texture_t texture;
+static unsigned char *png_bytes = NULL;
+static unsigned long png_size = 0;
+
+// Results of the math kernels end up here so they are not optimized away
+static volatile float sink;
+
+static double seconds_since(uint64_t begin) {
+  return (double)(SDL_GetPerformanceCounter() - begin) /
+         SDL_GetPerformanceFrequency();
+}
+
+// Same pseudo-random inputs on every run
+static float random_float(void) {
+  static uint32_t state = 12345;
+  state = state * 1664525 + 1013904223;
+  return (float)(state >> 8) / (1 << 24) * 2 - 1;
+}
+
+void init_inputs(void) {
+  for (int i = 0; i < NUM_INPUTS; i++) {
+    input_vectors[i] = (vec4_t){random_float(), random_float(),
+                                random_float(), 1.0};
+    input_matrices[i] = mat4_mul_mat4(mat4_make_rotation_x(random_float()),
+                                      mat4_make_rotation_y(random_float()));
+    input_points[i] = (vec2_t){random_float() * 100, random_float() * 100};
+  }
+}
+
+double bench_mat4_mul_vec4(int param, long ops, unsigned long *pixels) {
+  (void)param;
+  (void)pixels;
+  mat4_t m = input_matrices[0];
+  float sum = 0;
+  uint64_t begin = SDL_GetPerformanceCounter();
+  for (long i = 0; i < ops; i++) {
+    vec4_t v = mat4_mul_vec4(m, input_vectors[i % NUM_INPUTS]);
+    sum += v.x;
+  }
+  double seconds = seconds_since(begin);
+  sink = sum;
+  return seconds;
+}
+
+double bench_mat4_mul_mat4(int param, long ops, unsigned long *pixels) {
+  (void)param;
+  (void)pixels;
+  float sum = 0;
+  uint64_t begin = SDL_GetPerformanceCounter();
+  for (long i = 0; i < ops; i++) {
+    mat4_t m = mat4_mul_mat4(input_matrices[i % NUM_INPUTS],
+                             input_matrices[(i + 1) % NUM_INPUTS]);
+    sum += m.m[0][0];
+  }
+  double seconds = seconds_since(begin);
+  sink = sum;
+  return seconds;
+}
+
+double bench_vec3_normalize(int param, long ops, unsigned long *pixels) {
+  (void)param;
+  (void)pixels;
+  float sum = 0;
+  uint64_t begin = SDL_GetPerformanceCounter();
+  for (long i = 0; i < ops; i++) {
+    vec3_t v = vec3_from_vec4(input_vectors[i % NUM_INPUTS]);
+    vec3_normalize(&v);
+    sum += v.x;
+  }
+  double seconds = seconds_since(begin);
+  sink = sum;
+  return seconds;
+}
+
+double bench_barycentric_weights(int param, long ops, unsigned long *pixels) {
+  (void)param;
+  (void)pixels;
+  vec2_t a = {0, 0};
+  vec2_t b = {100, 10};
+  vec2_t c = {20, 100};
+  float sum = 0;
+  uint64_t begin = SDL_GetPerformanceCounter();
+  for (long i = 0; i < ops; i++) {
+    vec3_t weights = barycentric_weights(a, b, c, input_points[i % NUM_INPUTS]);
+    sum += weights.x;
+  }
+  double seconds = seconds_since(begin);
+  sink = sum;
+  return seconds;
+}
+
+// Lines of param pixels, turning around the center of the screen
+double bench_draw_line(int param, long ops, unsigned long *pixels) {
+  int x0 = SCREEN_WIDTH / 2;
+  int y0 = SCREEN_HEIGHT / 2;
+  int ends[NUM_INPUTS][2];
+  unsigned long line_pixels = 0;
+  for (int i = 0; i < NUM_INPUTS; i++) {
+    vec2_t direction = input_points[i];
+    vec2_normalize(&direction);
+    ends[i][0] = x0 + direction.x * (param - 1);
+    ends[i][1] = y0 + direction.y * (param - 1);
+    int dx = abs(ends[i][0] - x0);
+    int dy = abs(ends[i][1] - y0);
+    line_pixels += (dx > dy ? dx : dy) + 1;
+  }
+
+  uint64_t begin = SDL_GetPerformanceCounter();
+  for (long i = 0; i < ops; i++) {
+    const int *end = ends[i % NUM_INPUTS];
+    draw_line(x0, y0, end[0], end[1], 0xFFFFFFFF);
+  }
+  double seconds = seconds_since(begin);
+  *pixels += (unsigned long)((double)ops / NUM_INPUTS * line_pixels);
+  return seconds;
+}
+
+double bench_clear_color_buffer(int param, long ops, unsigned long *pixels) {
+  (void)param;
+  uint64_t begin = SDL_GetPerformanceCounter();
+  for (long i = 0; i < ops; i++) clear_color_buffer(0xFF000000 | (uint32_t)i);
+  double seconds = seconds_since(begin);
+  *pixels += (unsigned long)ops * SCREEN_WIDTH * SCREEN_HEIGHT;
+  return seconds;
+}
+
+// Set up a batch of right triangles with legs of size pixels, each nearer
+// than the previous one. The texture coordinates cover the whole texture
+void setup_triangle_batch(int size, raster_vertex_t *vertices,
+                          triangle_t *triangles) {
+  const tex2_t uvs[3] = {{0, 0}, {1, 0}, {0, 1}};
+  int x = (SCREEN_WIDTH - size) / 2;
+  int y = (SCREEN_HEIGHT - size) / 2;
+  for (int i = 0; i < TRIANGLE_BATCH; i++) {
+    float inv_w = 0.25 + 0.5 * i / TRIANGLE_BATCH;
+    raster_vertex_t *corner = &vertices[i * 3];
+    corner[0] = (raster_vertex_t){x, y, inv_w};
+    corner[1] = (raster_vertex_t){x + size, y, inv_w};
+    corner[2] = (raster_vertex_t){x, y + size, inv_w};
+
+    triangle_t *triangle = &triangles[i];
+    *triangle = (triangle_t){.vertices = {i * 3, i * 3 + 1, i * 3 + 2},
+                             .color = 0xFF808080};
+    triangle_setup(triangle, vertices, uvs, &texture);
+  }
+}
+
+// Draw batches of triangles, clearing the z-buffer between them outside of
+// the time measured
+double draw_triangles(int size, long ops, unsigned long *pixels,
+                      bool textured) {
+  raster_vertex_t vertices[TRIANGLE_BATCH * 3];
+  triangle_t triangles[TRIANGLE_BATCH];
+  setup_triangle_batch(size, vertices, triangles);
+
+  pipeline_stats_t stats = {0};
+  texture_block_cache_t block_cache;
+  block_cache.texture = NULL;
+  double seconds = 0;
+  for (long done = 0; done < ops; done += TRIANGLE_BATCH) {
+    long count = ops - done < TRIANGLE_BATCH ? ops - done : TRIANGLE_BATCH;
+    clear_z_buffer();
+
+    uint64_t begin = SDL_GetPerformanceCounter();
+    for (long i = 0; i < count; i++) {
+      if (textured) {
+        draw_textured_triangle(&triangles[i], vertices, &texture, &block_cache,
+                               &stats);
+      } else {
+        draw_filled_triangle(&triangles[i], vertices, &stats);
+      }
+    }
+    seconds += seconds_since(begin);
+  }
+
+  *pixels += stats.pixels_written;
+  return seconds;
+}
+
+double bench_draw_filled_triangle(int param, long ops, unsigned long *pixels) {
+  texture_filter = FILTER_NEAREST;
+  return draw_triangles(param, ops, pixels, false);
+}
+
+double bench_draw_textured_nearest(int param, long ops,
+                                   unsigned long *pixels) {
+  texture_filter = FILTER_NEAREST;
+  return draw_triangles(param, ops, pixels, true);
+}
+
+double bench_draw_textured_bilinear(int param, long ops,
+                                    unsigned long *pixels) {
+  texture_filter = FILTER_BILINEAR;
+  return draw_triangles(param, ops, pixels, true);
+}
+
+double bench_draw_textured_trilinear(int param, long ops,
+                                     unsigned long *pixels) {
+  texture_filter = FILTER_TRILINEAR;
+  return draw_triangles(param, ops, pixels, true);
+}
+
+// Decode the PNG read in memory, inflate and unfiltering of the scanlines
+double bench_upng_decode(int param, long ops, unsigned long *pixels) {
+  (void)param;
+  double seconds = 0;
+  for (long i = 0; i < ops; i++) {
+    uint64_t begin = SDL_GetPerformanceCounter();
+    upng_t *png = upng_new_from_bytes(png_bytes, png_size);
+    if (png == NULL) return -1;
+    upng_decode(png);
+    seconds += seconds_since(begin);
+
+    bool ok = upng_get_error(png) == UPNG_EOK;
+    *pixels += (unsigned long)upng_get_width(png) * upng_get_height(png);
+    upng_free(png);
+    if (!ok) return -1;
+  }
+  return seconds;
+}
+
+static const kernel_t kernels[] = {
+    {"mat4_mul_vec4", bench_mat4_mul_vec4, 0},
+    {"mat4_mul_mat4", bench_mat4_mul_mat4, 0},
+    {"vec3_normalize", bench_vec3_normalize, 0},
+    {"barycentric_weights", bench_barycentric_weights, 0},
+    {"draw_line_16", bench_draw_line, 16},
+    {"draw_line_256", bench_draw_line, 256},
+    {"clear_color_buffer", bench_clear_color_buffer, 0},
+    {"draw_filled_triangle_8", bench_draw_filled_triangle, 8},
+    {"draw_filled_triangle_32", bench_draw_filled_triangle, 32},
+    {"draw_filled_triangle_128", bench_draw_filled_triangle, 128},
+    {"draw_filled_triangle_512", bench_draw_filled_triangle, 512},
+    {"draw_textured_nearest_8", bench_draw_textured_nearest, 8},
+    {"draw_textured_nearest_32", bench_draw_textured_nearest, 32},
+    {"draw_textured_nearest_128", bench_draw_textured_nearest, 128},
+    {"draw_textured_nearest_512", bench_draw_textured_nearest, 512},
+    {"draw_textured_bilinear_128", bench_draw_textured_bilinear, 128},
+    {"draw_textured_trilinear_128", bench_draw_textured_trilinear, 128},
+    {"upng_decode", bench_upng_decode, 0},
+};
+#define NUM_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+// Whether a kernel was asked for on the command line, all of them if none
+bool is_selected(const char *name, int argc, char *argv[]) {
+  if (argc < 2) return true;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(name, argv[i], strlen(argv[i])) == 0) return true;
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  init_inputs();
+  depth_mode = DEPTH_LESS;
+  if (!pipeline_init(SCREEN_WIDTH, SCREEN_HEIGHT)) {
+    fprintf(stderr, "Error allocating the frame.\n");
+    return 1;
+  }
+  png_bytes = read_file(TEXTURE_FILE, &png_size);
+  if (png_bytes == NULL || !load_png_texture_data(&texture, TEXTURE_FILE)) {
+    fprintf(stderr, "Error loading %s.\n", TEXTURE_FILE);
+    return 1;
+  }
+
+  printf("%-28s %12s %12s %12s\n", "kernel", "ops", "ns/op", "Mpixels/s");
+  for (int k = 0; k < NUM_KERNELS; k++) {
+    if (!is_selected(kernels[k].name, argc, argv)) continue;
+
+    // Double the operations until the run is long enough to time
+    long ops = 1;
+    double seconds = 0;
+    unsigned long pixels = 0;
+    for (;;) {
+      pixels = 0;
+      seconds = kernels[k].run(kernels[k].param, ops, &pixels);
+      if (seconds < 0) {
+        fprintf(stderr, "Error running %s.\n", kernels[k].name);
+        return 1;
+      }
+      if (seconds >= MIN_SECONDS) break;
+      ops *= 2;
+    }
+
+    printf("%-28s %12ld %12.1f", kernels[k].name, ops, seconds / ops * 1e9);
+    if (pixels > 0) printf(" %12.1f", pixels / seconds / 1e6);
+    printf("\n");
+  }
+
+  free_texture_data(&texture);
+  free(png_bytes);
+  pipeline_free();
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+// Measure the PNG decode throughput of upng. Every file is read into memory
+// once and decoded repeatedly from there, so only inflate and the scanline
+// unfiltering are timed. Throughput is reported over the decoded image bytes
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "file.h"
+#include "upng.h"
+
+#define MIN_SECONDS 0.5
+#define MIN_RUNS 5
+
+static char *default_files[] = {
+    "./assets/crab.png", "./assets/drone.png", "./assets/efa.png",
+    "./assets/f117.png", "./assets/f22.png",   "./assets/cube.png",
+    "./assets/pikuma.png",
+};
+
+// Decode the PNG once, returning the time taken in seconds (or a negative
+// value on error) and the size of the decoded image
+double decode_once(const unsigned char *bytes, unsigned long size,
+                   unsigned long *decoded_size) {
+  clock_t start = clock();
+  upng_t *png = upng_new_from_bytes(bytes, size);
+  if (png == NULL) return -1;
+
+  upng_decode(png);
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  int ok = upng_get_error(png) == UPNG_EOK;
+  *decoded_size = upng_get_size(png);
+  upng_free(png);
+
+  return ok ? seconds : -1;
+}
+
+int main(int argc, char *argv[]) {
+  char **files = argc > 1 ? &argv[1] : default_files;
+  int num_files = argc > 1
+                      ? argc - 1
+                      : (int)(sizeof(default_files) / sizeof(default_files[0]));
+
+  printf("%-22s %10s %10s %8s %10s %10s\n", "file", "png bytes",
+         "raw bytes", "runs", "best ms", "MB/s");
+
+  double total_seconds = 0;
+  double total_bytes = 0;
+  for (int i = 0; i < num_files; i++) {
+    unsigned long size = 0;
+    unsigned char *bytes = read_file(files[i], &size);
+    if (bytes == NULL) {
+      fprintf(stderr, "Error reading %s.\n", files[i]);
+      return 1;
+    }
+
+    // Keep decoding until enough time passed to get a stable best time
+    unsigned long decoded_size = 0;
+    double best = -1;
+    double elapsed = 0;
+    int runs = 0;
+    while (runs < MIN_RUNS || elapsed < MIN_SECONDS) {
+      double seconds = decode_once(bytes, size, &decoded_size);
+      if (seconds < 0) {
+        fprintf(stderr, "Error decoding %s.\n", files[i]);
+        free(bytes);
+        return 1;
+      }
+      if (best < 0 || seconds < best) best = seconds;
+      elapsed += seconds;
+      runs++;
+    }
+
+    // clock() has a coarse resolution, so small images use the average
+    double per_decode = best > 0 ? best : elapsed / runs;
+    printf("%-22s %10lu %10lu %8d %10.3f %10.1f\n", files[i], size,
+           decoded_size, runs, per_decode * 1e3,
+           decoded_size / per_decode / 1e6);
+
+    total_seconds += per_decode;
+    total_bytes += decoded_size;
+    free(bytes);
+  }
+
+  printf("total: %.1f MB/s\n", total_bytes / total_seconds / 1e6);
+
+  return 0;
+}
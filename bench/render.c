@@ -0,0 +1,242 @@
+// Render every mesh along a fixed camera path, at several resolutions and with
+// every render method, without opening a window. The frames are timed from
+// the start of pipeline_build_frame to the end of pipeline_clear, and the
+// results are printed as JSON so runs of different versions can be compared.
+// With -latency N the geometry runs N frames ahead on the worker threads
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "job.h"
+#include "display.h"
+#include "mesh.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "texture_cache.h"
+
+#define PI 3.14159265358979323846264338327950288
+
+#define DEFAULT_FRAMES 120
+#define WARMUP_FRAMES 5
+
+static char *default_files[] = {
+    "./assets/crab.obj", "./assets/cube.obj", "./assets/drone.obj",
+    "./assets/efa.obj",  "./assets/f117.obj", "./assets/f22.obj",
+    "./assets/sphere.obj",
+};
+
+static const int resolutions[][2] = {{320, 240}, {800, 600}, {1280, 720}};
+#define NUM_RESOLUTIONS (int)(sizeof(resolutions) / sizeof(resolutions[0]))
+
+static const struct {
+  enum render_method method;
+  const char *name;
+} render_methods[] = {
+    {RENDER_WIRE, "wire"},
+    {RENDER_WIRE_VERTEX, "wire_vertex"},
+    {RENDER_FILL_TRIANGLE, "fill"},
+    {RENDER_FILL_TRIANGLE_WIRE, "fill_wire"},
+    {RENDER_TEXTURE, "texture"},
+    {RENDER_TEXTURE_WIRE, "texture_wire"},
+    {RENDER_TEXTURE_PREPASS, "texture_prepass"},
+};
+#define NUM_RENDER_METHODS \
+  (int)(sizeof(render_methods) / sizeof(render_methods[0]))
+
+// Place the mesh for a frame of the camera path: one turn around its vertical
+// axis while tilting and moving closer and away, the same on every run
+void place_mesh(mesh_t *mesh, int frame, int num_frames) {
+  float t = (float)frame / num_frames;
+  mesh->rotation.x = 0.25 * sin(2 * PI * t);
+  mesh->rotation.y = 2 * PI * t;
+  mesh->rotation.z = 0;
+  mesh->translation.x = 0;
+  mesh->translation.y = 0;
+  mesh->translation.z = 5.0 + 1.0 * sin(4 * PI * t);
+}
+
+// The texture of a mesh is the PNG file with the same name, if there is one
+texture_t *load_mesh_texture(const char *obj_filename) {
+  size_t length = strlen(obj_filename);
+  char *png_filename = (char *)malloc(length + 5);
+  if (png_filename == NULL) return NULL;
+
+  strcpy(png_filename, obj_filename);
+  if (length > 4 && strcmp(png_filename + length - 4, ".obj") == 0) {
+    png_filename[length - 4] = '\0';
+  }
+  strcat(png_filename, ".png");
+
+  texture_t *texture = NULL;
+  FILE *file = fopen(png_filename, "rb");
+  if (file) {
+    fclose(file);
+    texture = texture_cache_acquire(png_filename);
+  }
+  free(png_filename);
+  return texture;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted values
+double percentile(const double *sorted, int count, int percent) {
+  int rank = (count * percent + 99) / 100;
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Render the frames of the camera path, printing one JSON object with the
+// frame times, the average time of every stage and the average counters
+void bench_run(mesh_t *mesh, const char *filename, int width, int height,
+               int method, int num_frames, bool first_run) {
+  render_method = render_methods[method].method;
+
+  double *frame_ms = (double *)malloc(sizeof(double) * num_frames);
+  double stage_ms[PROFILE_STAGE_COUNT] = {0};
+  pipeline_stats_t total_stats = {0};
+  if (frame_ms == NULL) return;
+
+  // The frame rasterized in an iteration was built pipeline_latency
+  // iterations earlier, so the path is started that many iterations sooner
+  // and run that many past its end. Only frames both built and rasterized
+  // along the path are measured, the same ones whatever the latency
+  uint64_t ticks_per_ms = SDL_GetPerformanceFrequency() / 1000;
+  for (int built = -WARMUP_FRAMES; built < num_frames + pipeline_latency;
+       built++) {
+    place_mesh(mesh, built < 0 ? 0 : built, num_frames);
+
+    uint64_t begin = SDL_GetPerformanceCounter();
+    pipeline_build_frame(mesh);
+    pipeline_rasterize();
+    pipeline_clear();
+    uint64_t end = SDL_GetPerformanceCounter();
+    profile_end_frame();
+
+    int frame = built - pipeline_latency;
+    if (frame < 0) continue;
+    frame_ms[frame] = (double)(end - begin) / ticks_per_ms;
+    for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+      stage_ms[stage] += profile_last_frame(stage);
+    }
+    pipeline_stats_add(&total_stats, &frame_stats);
+  }
+  pipeline_flush();
+
+  double sum = 0;
+  for (int i = 0; i < num_frames; i++) sum += frame_ms[i];
+  double avg = sum / num_frames;
+  qsort(frame_ms, num_frames, sizeof(double), compare_doubles);
+
+  printf("%s    {\"mesh\": \"%s\", \"width\": %d, \"height\": %d, "
+         "\"render_method\": \"%s\",\n",
+         first_run ? "" : ",\n", filename, width, height,
+         render_methods[method].name);
+  printf("     \"fps\": %.2f, \"ms_per_frame\": {\"min\": %.3f, "
+         "\"avg\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+         "\"max\": %.3f},\n",
+         1000.0 / avg, frame_ms[0], avg, percentile(frame_ms, num_frames, 50),
+         percentile(frame_ms, num_frames, 90),
+         percentile(frame_ms, num_frames, 99), frame_ms[num_frames - 1]);
+
+  printf("     \"stages_ms\": {");
+  for (int stage = PROFILE_TRANSFORM; stage <= PROFILE_CLEAR; stage++) {
+    if (stage == PROFILE_PRESENT) continue;
+    printf("%s\"%s\": %.3f", stage == PROFILE_TRANSFORM ? "" : ", ",
+           profile_stage_name(stage), stage_ms[stage] / num_frames);
+  }
+  printf("},\n");
+
+  printf("     \"per_frame\": {\"faces\": %lu, \"backface_culled\": %lu, "
+         "\"frustum_culled\": %lu, \"triangles_rasterized\": %lu, "
+         "\"pixels_written\": %lu, \"texels_fetched\": %lu}}",
+         total_stats.faces / num_frames,
+         total_stats.backface_culled / num_frames,
+         total_stats.frustum_culled / num_frames,
+         total_stats.triangles_rasterized / num_frames,
+         total_stats.pixels_written / num_frames,
+         total_stats.texels_fetched / num_frames);
+  fflush(stdout);
+
+  free(frame_ms);
+}
+
+int main(int argc, char *argv[]) {
+  int num_frames = DEFAULT_FRAMES;
+  int first_file = 1;
+  while (first_file + 1 < argc && argv[first_file][0] == '-') {
+    if (strcmp(argv[first_file], "-frames") == 0) {
+      num_frames = atoi(argv[first_file + 1]);
+    } else if (strcmp(argv[first_file], "-latency") == 0) {
+      pipeline_latency = atoi(argv[first_file + 1]);
+    } else {
+      break;
+    }
+    first_file += 2;
+  }
+  if (num_frames < 1 || pipeline_latency < 0 ||
+      pipeline_latency > PIPELINE_MAX_LATENCY) {
+    fprintf(stderr, "usage: %s [-frames N] [-latency N] [mesh.obj...]\n",
+            argv[0]);
+    return 1;
+  }
+
+  char **files = argc > first_file ? &argv[first_file] : default_files;
+  int num_files =
+      argc > first_file
+          ? argc - first_file
+          : (int)(sizeof(default_files) / sizeof(default_files[0]));
+
+  cull_method = CULL_BACKFACE;
+  texture_filter = FILTER_NEAREST;
+  texture_cache_init(TEXTURE_CACHE_DEFAULT_BUDGET);
+  profile_init();
+  if (pipeline_latency > 0) job_system_init(0);
+
+  printf("{\"frames\": %d, \"warmup_frames\": %d, \"latency\": %d, "
+         "\"cull\": \"backface\", \"filter\": \"nearest\",\n \"runs\": [\n",
+         num_frames, WARMUP_FRAMES, pipeline_latency);
+
+  bool first_run = true;
+  for (int i = 0; i < num_files; i++) {
+    mesh_t bench_mesh = {.scale = {1, 1, 1}};
+    if (!load_obj_file_data(&bench_mesh, files[i])) {
+      fprintf(stderr, "Error loading %s.\n", files[i]);
+      return 1;
+    }
+    bench_mesh.texture = load_mesh_texture(files[i]);
+
+    for (int r = 0; r < NUM_RESOLUTIONS; r++) {
+      int width = resolutions[r][0];
+      int height = resolutions[r][1];
+      if (!pipeline_init(width, height)) {
+        fprintf(stderr, "Error allocating a %dx%d frame.\n", width, height);
+        return 1;
+      }
+
+      for (int method = 0; method < NUM_RENDER_METHODS; method++) {
+        fprintf(stderr, "%s %dx%d %s\n", files[i], width, height,
+                render_methods[method].name);
+        bench_run(&bench_mesh, files[i], width, height, method, num_frames,
+                  first_run);
+        first_run = false;
+      }
+      pipeline_free();
+    }
+
+    array_free(bench_mesh.vertices);
+    array_free(bench_mesh.faces);
+    texture_cache_release(bench_mesh.texture);
+  }
+
+  printf("\n]}\n");
+  texture_cache_free();
+  job_system_free();
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+// Compare the linear and tiled texture layouts sampling a texture along
+// rotated screen-space directions, as the rasterizer does for a rotating mesh.
+// Cache misses are counted with a simulated 32 KiB direct-mapped cache of
+// 64 byte lines, so the numbers are the same on every machine
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "texture.h"
+
+#define PI 3.14159265358979323846264338327950288
+
+#define SCREEN_SIZE 512
+#define CACHE_LINE_BITS 6
+#define CACHE_LINES 512
+
+typedef struct {
+  uintptr_t tags[CACHE_LINES];
+  unsigned long misses;
+} cache_t;
+
+void cache_access(cache_t *cache, const void *address) {
+  uintptr_t line = (uintptr_t)address >> CACHE_LINE_BITS;
+  uintptr_t *tag = &cache->tags[line % CACHE_LINES];
+  if (*tag != line) {
+    *tag = line;
+    cache->misses++;
+  }
+}
+
+// Sample one screen of texels with the texture rotated by angle, returning
+// the simulated misses and accumulating the time taken in seconds
+unsigned long sample_rotated(const mipmap_t *mipmap, float angle,
+                             double *seconds, uint32_t *checksum) {
+  cache_t *cache = (cache_t *)calloc(1, sizeof(cache_t));
+  float cos_a = cos(angle);
+  float sin_a = sin(angle);
+  uint32_t sum = 0;
+
+  // First pass measures time without the overhead of the simulated cache
+  clock_t start = clock();
+  for (int y = 0; y < SCREEN_SIZE; y++) {
+    for (int x = 0; x < SCREEN_SIZE; x++) {
+      int tex_x = abs((int)(x * cos_a - y * sin_a)) % mipmap->width;
+      int tex_y = abs((int)(x * sin_a + y * cos_a)) % mipmap->height;
+      sum += mipmap->texels[mipmap_offset(mipmap, tex_x, tex_y)];
+    }
+  }
+  *seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  for (int y = 0; y < SCREEN_SIZE; y++) {
+    for (int x = 0; x < SCREEN_SIZE; x++) {
+      int tex_x = abs((int)(x * cos_a - y * sin_a)) % mipmap->width;
+      int tex_y = abs((int)(x * sin_a + y * cos_a)) % mipmap->height;
+      cache_access(cache, &mipmap->texels[mipmap_offset(mipmap, tex_x, tex_y)]);
+    }
+  }
+
+  unsigned long misses = cache->misses;
+  free(cache);
+  *checksum += sum;
+  return misses;
+}
+
+int main(int argc, char *argv[]) {
+  char *filename = argc > 1 ? argv[1] : "./assets/crab.png";
+
+  // The texels of the tiled levels are read directly, so they must not be
+  // compressed
+  compress_textures = false;
+
+  texture_t texture;
+  if (!load_png_texture_data(&texture, filename)) {
+    fprintf(stderr, "Error loading texture %s.\n", filename);
+    return 1;
+  }
+
+  // The loader produces tiled levels, untile level 0 for the linear layout
+  mipmap_t tiled = texture.mipmaps[0];
+  mipmap_t linear =
+      make_mipmap((uint32_t *)malloc(sizeof(uint32_t) * tiled.width *
+                                     tiled.height),
+                  tiled.width, tiled.height, TEXTURE_LAYOUT_LINEAR);
+  for (int y = 0; y < tiled.height; y++) {
+    for (int x = 0; x < tiled.width; x++) {
+      linear.texels[mipmap_offset(&linear, x, y)] =
+          tiled.texels[mipmap_offset(&tiled, x, y)];
+    }
+  }
+
+  printf("texture %s (%dx%d), %dx%d samples per angle\n", filename,
+         tiled.width, tiled.height, SCREEN_SIZE, SCREEN_SIZE);
+  printf("%6s %14s %14s %12s %12s\n", "angle", "linear misses", "tiled misses",
+         "linear ns", "tiled ns");
+
+  uint32_t checksum_linear = 0;
+  uint32_t checksum_tiled = 0;
+  for (int degrees = 0; degrees <= 90; degrees += 15) {
+    float angle = degrees * PI / 180.0;
+    double linear_seconds = 0;
+    double tiled_seconds = 0;
+
+    unsigned long linear_misses =
+        sample_rotated(&linear, angle, &linear_seconds, &checksum_linear);
+    unsigned long tiled_misses =
+        sample_rotated(&tiled, angle, &tiled_seconds, &checksum_tiled);
+
+    printf("%6d %14lu %14lu %12.2f %12.2f\n", degrees, linear_misses,
+           tiled_misses, linear_seconds * 1e9 / (SCREEN_SIZE * SCREEN_SIZE),
+           tiled_seconds * 1e9 / (SCREEN_SIZE * SCREEN_SIZE));
+  }
+
+  if (checksum_linear != checksum_tiled) {
+    fprintf(stderr, "Error: tiled and linear samples differ.\n");
+    return 1;
+  }
+
+  free(linear.texels);
+  free_texture_data(&texture);
+
+  return 0;
+}
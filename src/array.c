@@ -1,42 +1,210 @@
 #include "array.h"
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define ARRAY_RAW_DATA(array) ((int *)(array)-2)
-#define ARRAY_CAPACITY(array) (ARRAY_RAW_DATA(array)[0])
-#define ARRAY_OCCUPIED(array) (ARRAY_RAW_DATA(array)[1])
+// Allocations of an arena are aligned for any type
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(size) \
+  (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
 
-void *array_hold(void *array, int count, int item_size) {
-  if (array == NULL) {
-    int raw_size = (sizeof(int) * 2) + (item_size * count);
-    int *base = (int *)malloc(raw_size);
-    base[0] = count; // capacity
-    base[1] = count; // occupied
-    return base + 2;
+// Header stored right before the items of an array
+typedef struct {
+  arena_t *arena;  // Arena holding the array, NULL when it is on the heap
+  size_t capacity;
+  size_t occupied;
+} array_header_t;
+
+#define ARRAY_HEADER(array) ((array_header_t *)(array)-1)
+
+struct arena_overflow {
+  struct arena_overflow *next;
+  size_t size;
+};
+
+bool arena_init(arena_t *arena, size_t capacity) {
+  arena->buffer = (char *)malloc(capacity);
+  arena->capacity = arena->buffer ? capacity : 0;
+  arena->used = 0;
+  arena->peak = 0;
+  arena->overflow = NULL;
+  return arena->buffer != NULL;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = ARENA_ALIGN(size);
+  arena->peak += size;
+
+  if (arena->used + size <= arena->capacity) {
+    void *memory = arena->buffer + arena->used;
+    arena->used += size;
+    return memory;
+  }
+
+  arena_overflow_t *overflow = (arena_overflow_t *)malloc(
+      ARENA_ALIGN(sizeof(arena_overflow_t)) + size);
+  if (overflow == NULL) return NULL;
+  overflow->next = arena->overflow;
+  overflow->size = size;
+  arena->overflow = overflow;
+  return (char *)overflow + ARENA_ALIGN(sizeof(arena_overflow_t));
+}
+
+// Release every allocation at once. If some did not fit since the last
+// reset, the buffer grows so the same allocations fit next time
+void arena_reset(arena_t *arena) {
+  while (arena->overflow) {
+    arena_overflow_t *next = arena->overflow->next;
+    free(arena->overflow);
+    arena->overflow = next;
+  }
 
-  } else if (ARRAY_OCCUPIED(array) + count <= ARRAY_CAPACITY(array)) {
-    ARRAY_OCCUPIED(array) += count;
-    return array;
+  if (arena->peak > arena->capacity) {
+    char *buffer = (char *)realloc(arena->buffer, arena->peak);
+    if (buffer) {
+      arena->buffer = buffer;
+      arena->capacity = arena->peak;
+    }
+  }
+
+  arena->used = 0;
+  arena->peak = 0;
+}
+
+void arena_free(arena_t *arena) {
+  arena_reset(arena);
+  free(arena->buffer);
+  arena->buffer = NULL;
+  arena->capacity = 0;
+}
+
+// The array behind a reference taken by the macros. The pointer is copied
+// as bytes since the reference points to a pointer of another type
+static void *load_array(void *array_ref) {
+  void *array;
+  memcpy(&array, array_ref, sizeof(array));
+  return array;
+}
+
+static void store_array(void *array_ref, void *array) {
+  memcpy(array_ref, &array, sizeof(array));
+}
+
+// Move the array to a block with room for capacity items, from its arena or
+// from the heap, or allocate it from the heap if it is NULL. Arena blocks are
+// not reused until the arena is reset. Returns NULL when out of memory or
+// when the size does not fit in a size_t, leaving the array untouched
+static void *array_resize(void *array, size_t capacity, size_t item_size) {
+  if (item_size > 0 &&
+      capacity > (SIZE_MAX - sizeof(array_header_t)) / item_size) {
+    return NULL;
+  }
+  size_t raw_size = sizeof(array_header_t) + item_size * capacity;
 
+  array_header_t *header;
+  if (array == NULL) {
+    header = (array_header_t *)malloc(raw_size);
+    if (header == NULL) return NULL;
+    header->arena = NULL;
+    header->occupied = 0;
+  } else if (ARRAY_HEADER(array)->arena == NULL) {
+    header = (array_header_t *)realloc(ARRAY_HEADER(array), raw_size);
+    if (header == NULL) return NULL;
   } else {
-    int needed_size = ARRAY_OCCUPIED(array) + count;
-    int float_curr = ARRAY_CAPACITY(array) * 2;
-    int capacity = needed_size > float_curr ? needed_size : float_curr;
-    int occupied = needed_size;
-    int raw_size = sizeof(int) * 2 + item_size * capacity;
-    int *base = (int *)realloc(ARRAY_RAW_DATA(array), raw_size);
-    base[0] = capacity;
-    base[1] = occupied;
-    return base + 2;
+    array_header_t *old = ARRAY_HEADER(array);
+    header = (array_header_t *)arena_alloc(old->arena, raw_size);
+    if (header == NULL) return NULL;
+    memcpy(header, old, sizeof(array_header_t) + item_size * old->occupied);
+  }
+
+  header->capacity = capacity;
+  return header + 1;
+}
+
+// Add count uninitialized items at the end, doubling the capacity when it
+// runs out so pushing one item at a time stays amortized constant
+bool array_grow_items(void *array_ref, size_t count, size_t item_size) {
+  void *array = load_array(array_ref);
+  size_t occupied = array_length(array);
+  if (count > SIZE_MAX - occupied) return false;
+
+  size_t needed = occupied + count;
+  if (needed > array_capacity(array)) {
+    size_t doubled = array_capacity(array) * 2;
+    size_t capacity = needed > doubled ? needed : doubled;
+    void *resized = array_resize(array, capacity, item_size);
+    // The doubled capacity may be what does not fit, try the exact one
+    if (resized == NULL && capacity > needed) {
+      resized = array_resize(array, needed, item_size);
+    }
+    if (resized == NULL) return false;
+    array = resized;
+    store_array(array_ref, array);
   }
+
+  ARRAY_HEADER(array)->occupied = needed;
+  return true;
+}
+
+// Make room for at least capacity items, so adding up to that many never
+// reallocates. A NULL array becomes an empty heap array
+bool array_reserve_items(void *array_ref, size_t capacity, size_t item_size) {
+  void *array = load_array(array_ref);
+  if (array != NULL && capacity <= array_capacity(array)) return true;
+
+  void *resized = array_resize(array, capacity, item_size);
+  if (resized == NULL) return false;
+  store_array(array_ref, resized);
+  return true;
 }
 
-int array_length(void *array) {
-  return (array != NULL) ? ARRAY_OCCUPIED(array) : 0;
+// Copy count items to the end of the array with a single reallocation
+bool array_append_items(void *array_ref, const void *items, size_t count,
+                        size_t item_size) {
+  size_t occupied = array_length(load_array(array_ref));
+  if (!array_grow_items(array_ref, count, item_size)) return false;
+
+  char *array = (char *)load_array(array_ref);
+  if (count > 0) {
+    memcpy(array + occupied * item_size, items, count * item_size);
+  }
+  return true;
+}
+
+// Create an empty array with room for capacity items in an arena. It grows
+// from the same arena and is released by resetting the arena, so array_free
+// ignores it
+void *array_arena_new(arena_t *arena, size_t capacity, size_t item_size) {
+  if (item_size > 0 &&
+      capacity > (SIZE_MAX - sizeof(array_header_t)) / item_size) {
+    return NULL;
+  }
+  array_header_t *header = (array_header_t *)arena_alloc(
+      arena, sizeof(array_header_t) + item_size * capacity);
+  if (header == NULL) return NULL;
+
+  header->arena = arena;
+  header->capacity = capacity;
+  header->occupied = 0;
+  return header + 1;
+}
+
+size_t array_length(const void *array) {
+  return (array != NULL) ? ARRAY_HEADER(array)->occupied : 0;
+}
+
+size_t array_capacity(const void *array) {
+  return (array != NULL) ? ARRAY_HEADER(array)->capacity : 0;
+}
+
+// Remove every item, keeping the memory to add new ones
+void array_clear(void *array) {
+  if (array != NULL) ARRAY_HEADER(array)->occupied = 0;
 }
 
 void array_free(void *array) {
-  if (array != NULL) {
-    free(ARRAY_RAW_DATA(array));
+  if (array != NULL && ARRAY_HEADER(array)->arena == NULL) {
+    free(ARRAY_HEADER(array));
   }
-}
\ No newline at end of file
+}
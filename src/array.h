@@ -1,14 +1,51 @@
 #ifndef ARRAY_H
 #define ARRAY_H
 
-#define array_push(array, value)                                               \
-  do {                                                                         \
-    (array) = array_hold((array), 1, sizeof(*(array)));                        \
-    (array)[array_length(array) - 1] = (value);                                \
-  } while (0);
-
-void *array_hold(void *array, int count, int item_size);
-int array_length(void *array);
+#include <stdbool.h>
+#include <stddef.h>
+
+// The macros take the array variable itself, which they update when the
+// items move. They return false when memory could not be allocated, leaving
+// the array as it was
+#define array_push(array, value)                                      \
+  (array_grow_items((void *)&(array), 1, sizeof(*(array)))            \
+       ? ((array)[array_length(array) - 1] = (value), true)           \
+       : false)
+
+#define array_reserve(array, capacity) \
+  array_reserve_items((void *)&(array), (capacity), sizeof(*(array)))
+
+#define array_append(array, items, count)                  \
+  array_append_items((void *)&(array), (items), (count),   \
+                     sizeof(*(array)))
+
+typedef struct arena_overflow arena_overflow_t;
+
+// Linear allocator for memory that lives until the next reset, like the
+// render lists of a frame. Allocations that do not fit in the buffer fall
+// back to malloc, and the next reset grows the buffer to the peak usage so
+// later frames allocate nothing
+typedef struct {
+  char *buffer;
+  size_t capacity;
+  size_t used;
+  size_t peak;                 // Bytes allocated since the last reset
+  arena_overflow_t *overflow;  // Allocations that did not fit in the buffer
+} arena_t;
+
+bool arena_init(arena_t *arena, size_t capacity);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+bool array_grow_items(void *array_ref, size_t count, size_t item_size);
+bool array_reserve_items(void *array_ref, size_t capacity, size_t item_size);
+bool array_append_items(void *array_ref, const void *items, size_t count,
+                        size_t item_size);
+void *array_arena_new(arena_t *arena, size_t capacity, size_t item_size);
+size_t array_length(const void *array);
+size_t array_capacity(const void *array);
+void array_clear(void *array);
 void array_free(void *array);
 
-#endif
\ No newline at end of file
+#endif
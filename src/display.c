@@ -4,9 +4,14 @@ SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
 SDL_Texture *color_buffer_texture = NULL;
 uint32_t *color_buffer = NULL;
+float *z_buffer = NULL;
 int window_width = 0;
 int window_height = 0;
 
+enum cull_method cull_method = CULL_NONE;
+enum render_method render_method = RENDER_WIRE;
+enum depth_mode depth_mode = DEPTH_LESS;
+
 bool initialize_window(void) {
   if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
     fprintf(stderr, "Error initializing SDL.\n");
@@ -53,7 +58,7 @@ void draw_grid(int size) {
 }
 
 void draw_pixel(int x, int y, uint32_t color) {
-  if (x < 0 || x > window_width || y < 0 || y > window_height)
+  if (x < 0 || x >= window_width || y < 0 || y >= window_height)
     return;
 
   color_buffer[window_width * y + x] = color;
@@ -94,8 +99,9 @@ void draw_rect(int x, int y, int width, int height, uint32_t color) {
   }
 }
 
-void render_color_buffer(void) {
-  SDL_UpdateTexture(color_buffer_texture, NULL, color_buffer,
+// Copy a color buffer to the texture displayed and draw it to the renderer
+void render_color_buffer(const uint32_t *buffer) {
+  SDL_UpdateTexture(color_buffer_texture, NULL, buffer,
                     (int)(window_width * sizeof(uint32_t)));
 
   SDL_RenderCopy(renderer, color_buffer_texture, NULL, NULL);
@@ -107,6 +113,13 @@ void clear_color_buffer(uint32_t color) {
   }
 }
 
+void clear_z_buffer(void) {
+  // The depth stored is 1 - 1/w, so 1.0 is the farthest possible value
+  for (int i = 0; i < window_height * window_width; i++) {
+    z_buffer[i] = 1.0;
+  }
+}
+
 void destroy_window(void) {
   // Destroy all SDL objects
   SDL_DestroyTexture(color_buffer_texture);
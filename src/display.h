@@ -8,7 +8,7 @@
 #define FPS 60
 #define FRAME_TARGET_TIME (1000 / FPS)
 
-enum cull_method { CULL_NONE, CULL_BACKFACE } cull_method;
+enum cull_method { CULL_NONE, CULL_BACKFACE };
 
 enum render_method {
   RENDER_WIRE,
@@ -16,14 +16,27 @@ enum render_method {
   RENDER_FILL_TRIANGLE,
   RENDER_FILL_TRIANGLE_WIRE,
   RENDER_TEXTURE,
-  RENDER_TEXTURE_WIRE
-} render_method;
+  RENDER_TEXTURE_WIRE,
+  RENDER_TEXTURE_PREPASS
+};
+
+// How the rasterizers use the z-buffer for each pixel they cover
+enum depth_mode {
+  DEPTH_LESS,  // Test and write depth, shading the pixels that pass
+  DEPTH_ONLY,  // Test and write depth without shading (depth pre-pass)
+  DEPTH_EQUAL  // Shade only the pixels whose depth matches the z-buffer
+};
+
+extern enum cull_method cull_method;
+extern enum render_method render_method;
+extern enum depth_mode depth_mode;
 
 extern SDL_Window *window;
 extern SDL_Renderer *renderer;
 extern SDL_Texture *color_buffer_texture;
 
 extern uint32_t *color_buffer;
+extern float *z_buffer;
 extern int window_width;
 extern int window_height;
 
@@ -32,8 +45,9 @@ void draw_grid(int size);
 void draw_pixel(int x, int y, uint32_t color);
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color);
 void draw_rect(int x, int y, int width, int height, uint32_t color);
-void render_color_buffer(void);
+void render_color_buffer(const uint32_t *buffer);
 void clear_color_buffer(uint32_t color);
+void clear_z_buffer(void);
 void destroy_window(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,48 @@
+#include "file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Read a whole file into a buffer the caller frees, storing its size.
+// Returns NULL if the file can not be read or is empty
+unsigned char *read_file(const char *filename, unsigned long *size) {
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) return NULL;
+
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  rewind(file);
+
+  unsigned char *buffer = NULL;
+  if (length > 0) buffer = (unsigned char *)malloc(length);
+  if (buffer && fread(buffer, 1, length, file) != (size_t)length) {
+    free(buffer);
+    buffer = NULL;
+  }
+  fclose(file);
+
+  *size = (unsigned long)length;
+  return buffer;
+}
+
+// Whether both files can be read and hold the same bytes, compared a piece
+// at a time without reading either file whole
+bool files_equal(const char *filename, const char *other_filename) {
+  FILE *file = fopen(filename, "rb");
+  FILE *other_file = fopen(other_filename, "rb");
+  bool equal = file && other_file;
+
+  unsigned char piece[4096];
+  unsigned char other_piece[4096];
+  while (equal) {
+    size_t size = fread(piece, 1, sizeof(piece), file);
+    size_t other_size = fread(other_piece, 1, sizeof(other_piece), other_file);
+    equal = size == other_size && memcmp(piece, other_piece, size) == 0;
+    if (size < sizeof(piece)) break;
+  }
+
+  if (file) fclose(file);
+  if (other_file) fclose(other_file);
+  return equal;
+}
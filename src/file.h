@@ -0,0 +1,9 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdbool.h>
+
+unsigned char *read_file(const char *filename, unsigned long *size);
+bool files_equal(const char *filename, const char *other_filename);
+
+#endif
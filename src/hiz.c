@@ -0,0 +1,150 @@
+#include "hiz.h"
+
+#include <stdlib.h>
+
+#include "display.h"
+
+#define HIZ_COARSE_SIZE (HIZ_TILE_SIZE * HIZ_COARSE_FACTOR)
+
+// Two levels of the depth pyramid: fine tiles of HIZ_TILE_SIZE pixels and
+// coarse tiles covering HIZ_COARSE_FACTOR x HIZ_COARSE_FACTOR fine tiles
+static hiz_tile_t *fine_tiles = NULL;
+static hiz_tile_t *coarse_tiles = NULL;
+static int fine_cols = 0;
+static int fine_rows = 0;
+static int coarse_cols = 0;
+static int coarse_rows = 0;
+
+bool hiz_init(int width, int height) {
+  fine_cols = (width + HIZ_TILE_SIZE - 1) / HIZ_TILE_SIZE;
+  fine_rows = (height + HIZ_TILE_SIZE - 1) / HIZ_TILE_SIZE;
+  coarse_cols = (fine_cols + HIZ_COARSE_FACTOR - 1) / HIZ_COARSE_FACTOR;
+  coarse_rows = (fine_rows + HIZ_COARSE_FACTOR - 1) / HIZ_COARSE_FACTOR;
+
+  fine_tiles = (hiz_tile_t *)malloc(sizeof(hiz_tile_t) * fine_cols * fine_rows);
+  coarse_tiles =
+      (hiz_tile_t *)malloc(sizeof(hiz_tile_t) * coarse_cols * coarse_rows);
+
+  if (!fine_tiles || !coarse_tiles) {
+    hiz_free();
+    return false;
+  }
+
+  hiz_clear();
+  return true;
+}
+
+void hiz_clear(void) {
+  // Matches the cleared z-buffer, where every pixel is at the far plane
+  hiz_tile_t far_tile = {.min_depth = 1.0, .max_depth = 1.0};
+
+  for (int i = 0; i < fine_cols * fine_rows; i++) {
+    fine_tiles[i] = far_tile;
+  }
+  for (int i = 0; i < coarse_cols * coarse_rows; i++) {
+    coarse_tiles[i] = far_tile;
+  }
+}
+
+// Clamp an inclusive pixel rectangle to the screen, returning false when
+// nothing of it is left on screen
+static bool clamp_rect(int *min_x, int *min_y, int *max_x, int *max_y) {
+  if (*min_x < 0) *min_x = 0;
+  if (*min_y < 0) *min_y = 0;
+  if (*max_x > window_width - 1) *max_x = window_width - 1;
+  if (*max_y > window_height - 1) *max_y = window_height - 1;
+
+  return *min_x <= *max_x && *min_y <= *max_y;
+}
+
+void hiz_update(int min_x, int min_y, int max_x, int max_y) {
+  if (!clamp_rect(&min_x, &min_y, &max_x, &max_y)) return;
+
+  // Recompute the fine tiles touched by the rectangle from the z-buffer
+  for (int ty = min_y / HIZ_TILE_SIZE; ty <= max_y / HIZ_TILE_SIZE; ty++) {
+    for (int tx = min_x / HIZ_TILE_SIZE; tx <= max_x / HIZ_TILE_SIZE; tx++) {
+      int x_end = (tx + 1) * HIZ_TILE_SIZE;
+      int y_end = (ty + 1) * HIZ_TILE_SIZE;
+      if (x_end > window_width) x_end = window_width;
+      if (y_end > window_height) y_end = window_height;
+
+      hiz_tile_t tile = {.min_depth = 1.0, .max_depth = 0.0};
+      for (int y = ty * HIZ_TILE_SIZE; y < y_end; y++) {
+        for (int x = tx * HIZ_TILE_SIZE; x < x_end; x++) {
+          float depth = z_buffer[window_width * y + x];
+          if (depth < tile.min_depth) tile.min_depth = depth;
+          if (depth > tile.max_depth) tile.max_depth = depth;
+        }
+      }
+      fine_tiles[fine_cols * ty + tx] = tile;
+    }
+  }
+
+  // Propagate the changes to the coarse tiles above them
+  for (int cy = min_y / HIZ_COARSE_SIZE; cy <= max_y / HIZ_COARSE_SIZE; cy++) {
+    for (int cx = min_x / HIZ_COARSE_SIZE; cx <= max_x / HIZ_COARSE_SIZE;
+         cx++) {
+      int tx_end = (cx + 1) * HIZ_COARSE_FACTOR;
+      int ty_end = (cy + 1) * HIZ_COARSE_FACTOR;
+      if (tx_end > fine_cols) tx_end = fine_cols;
+      if (ty_end > fine_rows) ty_end = fine_rows;
+
+      hiz_tile_t tile = {.min_depth = 1.0, .max_depth = 0.0};
+      for (int ty = cy * HIZ_COARSE_FACTOR; ty < ty_end; ty++) {
+        for (int tx = cx * HIZ_COARSE_FACTOR; tx < tx_end; tx++) {
+          hiz_tile_t fine = fine_tiles[fine_cols * ty + tx];
+          if (fine.min_depth < tile.min_depth) tile.min_depth = fine.min_depth;
+          if (fine.max_depth > tile.max_depth) tile.max_depth = fine.max_depth;
+        }
+      }
+      coarse_tiles[coarse_cols * cy + cx] = tile;
+    }
+  }
+}
+
+bool hiz_is_occluded(int min_x, int min_y, int max_x, int max_y,
+                     float min_depth) {
+  // Geometry that is completely off screen can never be seen
+  if (!clamp_rect(&min_x, &min_y, &max_x, &max_y)) return true;
+
+  for (int cy = min_y / HIZ_COARSE_SIZE; cy <= max_y / HIZ_COARSE_SIZE; cy++) {
+    for (int cx = min_x / HIZ_COARSE_SIZE; cx <= max_x / HIZ_COARSE_SIZE;
+         cx++) {
+      hiz_tile_t coarse = coarse_tiles[coarse_cols * cy + cx];
+
+      // Everything stored in this coarse tile is nearer than the geometry.
+      // Equal depths are not rejected so this also holds for DEPTH_EQUAL
+      if (min_depth > coarse.max_depth) continue;
+
+      // The geometry is nearer than everything stored in this coarse tile
+      if (min_depth < coarse.min_depth) return false;
+
+      // Otherwise refine the test with the fine tiles under the rectangle
+      int tx_start = cx * HIZ_COARSE_FACTOR;
+      int ty_start = cy * HIZ_COARSE_FACTOR;
+      int tx_end = tx_start + HIZ_COARSE_FACTOR - 1;
+      int ty_end = ty_start + HIZ_COARSE_FACTOR - 1;
+      if (tx_start < min_x / HIZ_TILE_SIZE) tx_start = min_x / HIZ_TILE_SIZE;
+      if (ty_start < min_y / HIZ_TILE_SIZE) ty_start = min_y / HIZ_TILE_SIZE;
+      if (tx_end > max_x / HIZ_TILE_SIZE) tx_end = max_x / HIZ_TILE_SIZE;
+      if (ty_end > max_y / HIZ_TILE_SIZE) ty_end = max_y / HIZ_TILE_SIZE;
+
+      for (int ty = ty_start; ty <= ty_end; ty++) {
+        for (int tx = tx_start; tx <= tx_end; tx++) {
+          if (min_depth <= fine_tiles[fine_cols * ty + tx].max_depth) {
+            return false;
+          }
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+void hiz_free(void) {
+  free(fine_tiles);
+  free(coarse_tiles);
+  fine_tiles = NULL;
+  coarse_tiles = NULL;
+}
@@ -0,0 +1,24 @@
+#ifndef HIZ_H
+#define HIZ_H
+
+#include <stdbool.h>
+
+// Size in pixels of the fine tiles, and how many fine tiles make one side of
+// a coarse tile (8 * 8 = 64x64 pixels per coarse tile)
+#define HIZ_TILE_SIZE 8
+#define HIZ_COARSE_FACTOR 8
+
+// Nearest and farthest depth (1 - 1/w) stored in the z-buffer for a tile
+typedef struct {
+  float min_depth;
+  float max_depth;
+} hiz_tile_t;
+
+bool hiz_init(int width, int height);
+void hiz_clear(void);
+void hiz_update(int min_x, int min_y, int max_x, int max_y);
+bool hiz_is_occluded(int min_x, int min_y, int max_x, int max_y,
+                     float min_depth);
+void hiz_free(void);
+
+#endif
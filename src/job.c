@@ -0,0 +1,198 @@
+#include "job.h"
+
+#include <SDL2/SDL.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+// Most worker threads started, whatever the number of CPUs
+#define MAX_WORKERS 16
+
+struct job {
+  job_function_t function;
+  void *data;
+  int result;
+  bool done;
+  struct job *next;  // Next job in the queue
+};
+
+static SDL_Thread *workers[MAX_WORKERS];
+static int num_workers = 0;
+
+// The queue and the done flag of every job are protected by one mutex, jobs
+// are coarse (whole assets) so it is rarely contended
+static SDL_mutex *job_mutex = NULL;
+static SDL_cond *job_queued = NULL;
+static SDL_cond *job_finished = NULL;
+static job_t *queue_first = NULL;
+static job_t *queue_last = NULL;
+static bool is_stopping = false;
+
+// Jobs waited for, linked through next and reused by job_submit, so a job
+// submitted every frame does not allocate once the workers run
+static job_t *free_jobs = NULL;
+
+// Take jobs from the queue until the job system is freed and the queue is
+// empty, so every submitted job runs before the workers exit
+static int worker_main(void *unused) {
+  (void)unused;
+  trace_set_thread_name("worker");
+
+  SDL_LockMutex(job_mutex);
+  while (true) {
+    while (queue_first == NULL && !is_stopping) {
+      SDL_CondWait(job_queued, job_mutex);
+    }
+    if (queue_first == NULL) break;
+
+    job_t *job = queue_first;
+    queue_first = job->next;
+    if (queue_first == NULL) queue_last = NULL;
+    SDL_UnlockMutex(job_mutex);
+
+    trace_zone_t zone = trace_begin("job");
+    int result = job->function(job->data);
+    trace_end(zone);
+
+    SDL_LockMutex(job_mutex);
+    job->result = result;
+    job->done = true;
+    SDL_CondBroadcast(job_finished);
+  }
+  SDL_UnlockMutex(job_mutex);
+  return 0;
+}
+
+// Start the worker threads, one per CPU beside the main thread when
+// num_workers is 0. Without workers the jobs run when they are submitted
+bool job_system_init(int num_workers_requested) {
+  job_system_free();
+
+  if (num_workers_requested <= 0) {
+    num_workers_requested = SDL_GetCPUCount() - 1;
+    if (num_workers_requested < 1) num_workers_requested = 1;
+  }
+  if (num_workers_requested > MAX_WORKERS) num_workers_requested = MAX_WORKERS;
+
+  job_mutex = SDL_CreateMutex();
+  job_queued = SDL_CreateCond();
+  job_finished = SDL_CreateCond();
+  if (!job_mutex || !job_queued || !job_finished) {
+    job_system_free();
+    return false;
+  }
+
+  is_stopping = false;
+  for (int i = 0; i < num_workers_requested; i++) {
+    workers[num_workers] = SDL_CreateThread(worker_main, "worker", NULL);
+    if (workers[num_workers] == NULL) break;
+    num_workers++;
+  }
+
+  if (num_workers == 0) {
+    job_system_free();
+    return false;
+  }
+  return true;
+}
+
+int job_system_num_workers(void) { return num_workers; }
+
+// Take a job from the free list, allocating one only when it is empty
+static job_t *allocate_job(void) {
+  job_t *job = NULL;
+  if (num_workers > 0) {
+    SDL_LockMutex(job_mutex);
+    job = free_jobs;
+    if (job) free_jobs = job->next;
+    SDL_UnlockMutex(job_mutex);
+  }
+  if (job == NULL) job = (job_t *)malloc(sizeof(job_t));
+  return job;
+}
+
+// Queue a function to run on a worker thread, returning the future of its
+// result. Returns NULL if the job could not be allocated
+job_t *job_submit(job_function_t function, void *data) {
+  job_t *job = allocate_job();
+  if (job == NULL) return NULL;
+
+  job->function = function;
+  job->data = data;
+  job->result = 0;
+  job->done = false;
+  job->next = NULL;
+
+  if (num_workers == 0) {
+    job->result = function(data);
+    job->done = true;
+    return job;
+  }
+
+  SDL_LockMutex(job_mutex);
+  if (queue_last) {
+    queue_last->next = job;
+  } else {
+    queue_first = job;
+  }
+  queue_last = job;
+  SDL_CondSignal(job_queued);
+  SDL_UnlockMutex(job_mutex);
+
+  return job;
+}
+
+bool job_is_done(job_t *job) {
+  if (num_workers == 0) return job->done;
+
+  SDL_LockMutex(job_mutex);
+  bool done = job->done;
+  SDL_UnlockMutex(job_mutex);
+  return done;
+}
+
+// Block until the job finished and return its result. The future is put
+// back on the free list, so every job is waited for exactly once
+int job_wait(job_t *job) {
+  if (num_workers == 0) {
+    int result = job->result;
+    free(job);
+    return result;
+  }
+
+  SDL_LockMutex(job_mutex);
+  while (!job->done) SDL_CondWait(job_finished, job_mutex);
+  int result = job->result;
+  job->next = free_jobs;
+  free_jobs = job;
+  SDL_UnlockMutex(job_mutex);
+  return result;
+}
+
+// Let the workers finish the queued jobs and stop them
+void job_system_free(void) {
+  if (job_mutex) {
+    SDL_LockMutex(job_mutex);
+    is_stopping = true;
+    SDL_CondBroadcast(job_queued);
+    SDL_UnlockMutex(job_mutex);
+  }
+
+  for (int i = 0; i < num_workers; i++) {
+    SDL_WaitThread(workers[i], NULL);
+  }
+  num_workers = 0;
+
+  while (free_jobs) {
+    job_t *job = free_jobs;
+    free_jobs = job->next;
+    free(job);
+  }
+
+  SDL_DestroyCond(job_finished);
+  SDL_DestroyCond(job_queued);
+  SDL_DestroyMutex(job_mutex);
+  job_finished = NULL;
+  job_queued = NULL;
+  job_mutex = NULL;
+}
@@ -0,0 +1,19 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <stdbool.h>
+
+// Function run by a worker thread, its return value is the result of the job
+typedef int (*job_function_t)(void *data);
+
+// Future of a submitted job, waited for once with job_wait
+typedef struct job job_t;
+
+bool job_system_init(int num_workers);
+int job_system_num_workers(void);
+job_t *job_submit(job_function_t function, void *data);
+bool job_is_done(job_t *job);
+int job_wait(job_t *job);
+void job_system_free(void);
+
+#endif
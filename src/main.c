@@ -1,37 +1,68 @@
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "array.h"
 #include "display.h"
-#include "light.h"
-#include "matrix.h"
+#include "job.h"
 #include "mesh.h"
+#include "pipeline.h"
+#include "present.h"
+#include "profile.h"
 #include "texture.h"
+#include "texture_cache.h"
+#include "trace.h"
 #include "triangle.h"
 #include "upng.h"
 #include "vector.h"
 
-#define PI 3.14159265358979323846264338327950288
+// File the trace of the last frames is written to, on exit or with 'r'
+#define TRACE_FILENAME "trace.json"
 
-// Array of triangles that should be renderer frame by frame
-triangle_t *triangles_to_render = NULL;
+// The simulation advances in fixed steps of 1 / UPDATES_PER_SECOND seconds,
+// whatever the render rate. After a long stall at most MAX_FRAME_SECONDS are
+// simulated, so a slow frame does not need even more steps after it
+#define UPDATES_PER_SECOND 60
+#define MAX_FRAME_SECONDS 0.25
+
+// Below this many seconds to the next frame the limiter spins instead of
+// sleeping, SDL_Delay can oversleep by about a millisecond
+#define SPIN_SECONDS 0.002
+
+// Speed the mesh turns at, in radians per second
+#define MESH_ROTATION_SPEED 0.3
+
+// Transform of the mesh at one simulation step
+typedef struct {
+  vec3_t rotation;
+  vec3_t translation;
+} mesh_state_t;
 
 // Global variables
 bool is_running = false;
-int previous_frame_rate = 0;
 
-vec3_t camera_position = {.x = 0, .y = 0, .z = 0};
-mat4_t proj_matrix;
+// Frames rendered per second at most, 0 to render as fast as possible
+int max_frame_rate = FPS;
+
+// Color buffers the frames are drawn into in turn, 1 to draw and present
+// every frame on the main thread one after the other
+int num_color_buffers = 2;
+
+uint64_t previous_frame_time = 0;
+uint64_t next_frame_time = 0;
+double update_accumulator = 0;
+
+// The mesh is drawn between the last two simulation steps, at the time
+// left in the accumulator
+mesh_state_t previous_state;
+mesh_state_t current_state;
 
 void setup(void) {
   render_method = RENDER_TEXTURE_WIRE;
   // cull_method = CULL_BACKFACE;
 
-  // Allocating the required memory in bytes to hold the color buffer
-  color_buffer =
-      (uint32_t *)malloc(sizeof(uint32_t) * window_width * window_height);
-
-  // Check if the memory was allocated
-  if (!color_buffer) {
+  // Allocating the color buffer, the z-buffer and the render lists
+  if (!pipeline_init(window_width, window_height)) {
     is_running = false;
     return;
   }
@@ -41,19 +72,46 @@ void setup(void) {
                                            SDL_TEXTUREACCESS_STREAMING,
                                            window_width, window_height);
 
-  // Initialize the perspective projection matrix
-  float fov = PI / 3.0;  // the same as 160/3 deg but in rad
-  float aspect = (float)window_height / (float)window_width;
-  float znear = 0.1;
-  float zfar = 100.0;
-  proj_matrix = mat4_make_perspective(fov, aspect, znear, zfar);
+  trace_init();
+  trace_set_thread_name("main");
+  profile_init();
+
+  // Draw each frame on a worker thread while the previous one is presented
+  if (!present_init(num_color_buffers)) {
+    fprintf(stderr, "Error allocating the color buffers.\n");
+  }
+
+  // Load the mesh and its texture on worker threads at the same time, so
+  // startup waits for the slower of the two instead of both. Meshes using
+  // the same PNG file share one decoded copy through the texture cache
+  job_system_init(0);
+  texture_cache_init(TEXTURE_CACHE_DEFAULT_BUDGET);
 
-  // Load the mesh values in the data structure
   // load_cube_mesh_data();
-  load_obj_file_data("./assets/crab.obj");
+  job_t *mesh_job = load_obj_file_async(&mesh, "./assets/crab.obj");
+  job_t *texture_job =
+      texture_cache_acquire_async("./assets/crab.png", &mesh.texture);
+
+  if (!mesh_job || !job_wait(mesh_job)) {
+    fprintf(stderr, "Error loading the mesh.\n");
+  }
+  if (!texture_job || !job_wait(texture_job)) {
+    fprintf(stderr, "Error loading the mesh texture.\n");
+  }
 
-  // Load the texture information from an external PNG file
-  load_png_texture_data("./assets/crab.png");
+  current_state.rotation = mesh.rotation;
+  current_state.translation = (vec3_t){0, 0, 5.0};
+  previous_state = current_state;
+  previous_frame_time = SDL_GetPerformanceCounter();
+  next_frame_time = previous_frame_time;
+}
+
+void dump_trace(void) {
+  if (trace_dump(TRACE_FILENAME)) {
+    printf("Trace written to %s.\n", TRACE_FILENAME);
+  } else {
+    fprintf(stderr, "Error writing the trace to %s.\n", TRACE_FILENAME);
+  }
 }
 
 void process_input(void) {
@@ -74,239 +132,122 @@ void process_input(void) {
         render_method = RENDER_FILL_TRIANGLE_WIRE;
       if (event.key.keysym.sym == SDLK_5) render_method = RENDER_TEXTURE;
       if (event.key.keysym.sym == SDLK_6) render_method = RENDER_TEXTURE_WIRE;
+      if (event.key.keysym.sym == SDLK_7)
+        render_method = RENDER_TEXTURE_PREPASS;
+
+      if (event.key.keysym.sym == SDLK_n) texture_filter = FILTER_NEAREST;
+      if (event.key.keysym.sym == SDLK_b) texture_filter = FILTER_BILINEAR;
+      if (event.key.keysym.sym == SDLK_t) texture_filter = FILTER_TRILINEAR;
 
       if (event.key.keysym.sym == SDLK_c) cull_method = CULL_BACKFACE;
       if (event.key.keysym.sym == SDLK_d) cull_method = CULL_NONE;
 
+      if (event.key.keysym.sym == SDLK_o) show_overdraw = !show_overdraw;
+      if (event.key.keysym.sym == SDLK_p) show_profile = !show_profile;
+      if (event.key.keysym.sym == SDLK_r) dump_trace();
+
       break;
   }
 }
 
-void fix_frame_rate() {
-  int time_to_wait = previous_frame_rate + FRAME_TARGET_TIME - SDL_GetTicks();
-  // Only delay if we are running to fast
-  if (time_to_wait > 0 && time_to_wait <= FRAME_TARGET_TIME) {
-    SDL_Delay(time_to_wait);
+// Wait until the next frame is due at max_frame_rate, sleeping for most of
+// the time and spinning on the high resolution counter for the rest
+void fix_frame_rate(void) {
+  if (max_frame_rate <= 0) return;
+
+  uint64_t frequency = SDL_GetPerformanceFrequency();
+  uint64_t frame_ticks = frequency / max_frame_rate;
+  uint64_t now = SDL_GetPerformanceCounter();
+  next_frame_time += frame_ticks;
+
+  // Start over from now when more than a frame late, instead of rendering
+  // frames back to back to catch up
+  if (now > next_frame_time + frame_ticks) next_frame_time = now;
+  if (now >= next_frame_time) return;
+
+  trace_zone_t zone = trace_begin("wait");
+  uint64_t spin_ticks = (uint64_t)(SPIN_SECONDS * frequency);
+  if (next_frame_time - now > spin_ticks) {
+    SDL_Delay((uint32_t)((next_frame_time - now - spin_ticks) * 1000 /
+                         frequency));
+  }
+  while (SDL_GetPerformanceCounter() < next_frame_time) {
   }
-  previous_frame_rate = SDL_GetTicks();
+  trace_end(zone);
+}
+
+// Advance the simulation by one fixed step
+void simulate(mesh_state_t *state, double seconds) {
+  // state->rotation.x += MESH_ROTATION_SPEED * seconds;
+  state->rotation.y += MESH_ROTATION_SPEED * seconds;
+  // state->rotation.z += MESH_ROTATION_SPEED * seconds;
+  state->translation.z = 5.0;
 }
 
 void update(void) {
   fix_frame_rate();
 
-  // Change the mesh scale, rotation, and translation values per animation frame
-  // mesh.rotation.x += 0.005;
-  mesh.rotation.y += 0.005;
-  // mesh.rotation.z += 0.005;
-  mesh.translation.z = 5.0;
-
-  // Create scale, rotation, and translation matrices that will be used to
-  // multiply the mesh vertices
-  mat4_t scale_matrix =
-      mat4_make_scale(mesh.scale.x, mesh.scale.y, mesh.scale.z);
-  mat4_t translation_matrix = mat4_make_translation(
-      mesh.translation.x, mesh.translation.y, mesh.translation.z);
-  mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh.rotation.x);
-  mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh.rotation.y);
-  mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh.rotation.z);
-
-  // Create a World Matrix combining scale, rotation, and translation matrices
-  mat4_t world_matrix = mat4_identity();
-
-  // Order matters: First scale, then rotate, then translate. [T]*[R]*[S]*v
-  world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-  world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-  world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-  world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-  world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
-
-  // Loop all triangle faces of our mesh
-  int num_faces = array_length(mesh.faces);
-  for (int i = 0; i < num_faces; i++) {
-    face_t mesh_face = mesh.faces[i];
-
-    vec3_t face_vertices[3];
-    face_vertices[1] = mesh.vertices[mesh_face.b];
-    face_vertices[2] = mesh.vertices[mesh_face.c];
-    face_vertices[0] = mesh.vertices[mesh_face.a];
-
-    vec4_t transformed_vertices[3];
-
-    // Loop all three vertices of this current face and apply transformations
-    for (int j = 0; j < 3; j++) {
-      vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
-
-      // Multiply the world matrix by the original vector
-      transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
-
-      // Save transformed vertex in the array of transformed vertices
-      transformed_vertices[j] = transformed_vertex;
-    }
-
-    // Get individual vectors from A, B, and C vertices to compute normal
-    vec3_t vector_a = vec3_from_vec4(transformed_vertices[0]); /*   A   */
-    vec3_t vector_b = vec3_from_vec4(transformed_vertices[1]); /*  / \  */
-    vec3_t vector_c = vec3_from_vec4(transformed_vertices[2]); /* C---B */
-
-    // Get the vector subtraction of B-A and C-A
-    vec3_t vector_ab = vec3_sub(vector_b, vector_a);
-    vec3_t vector_ac = vec3_sub(vector_c, vector_a);
-    vec3_normalize(&vector_ab);
-    vec3_normalize(&vector_ac);
-
-    // Compute the face normal (using cross product to find perpendicular)
-    vec3_t normal = vec3_cross(vector_ab, vector_ac);
-    vec3_normalize(&normal);
-
-    // Find the vector between vertex A in the triangle and the camera origin
-    vec3_t camera_ray = vec3_sub(camera_position, vector_a);
-
-    // Calculate how aligned the camera ray is with the face normal (using dot
-    // product)
-    float dot_normal_camera = vec3_dot(normal, camera_ray);
-
-    // Backface culling test to see if the current face should be projected
-    if (cull_method == CULL_BACKFACE) {
-      // Backface culling, bypassing triangles that are looking away from the
-      // camera
-      if (dot_normal_camera < 0) {
-        continue;
-      }
-    }
-
-    vec4_t projected_points[3];
-
-    // Loop all three vertices to perform projection
-    for (int j = 0; j < 3; j++) {
-      // Project the current vertex
-      projected_points[j] =
-          mat4_mul_vec4_project(proj_matrix, transformed_vertices[j]);
+  // Run as many simulation steps as the time since the last frame holds
+  const double step = 1.0 / UPDATES_PER_SECOND;
+  uint64_t now = SDL_GetPerformanceCounter();
+  double frame_seconds =
+      (double)(now - previous_frame_time) / SDL_GetPerformanceFrequency();
+  previous_frame_time = now;
+  if (frame_seconds > MAX_FRAME_SECONDS) frame_seconds = MAX_FRAME_SECONDS;
+
+  update_accumulator += frame_seconds;
+  while (update_accumulator >= step) {
+    previous_state = current_state;
+    simulate(&current_state, step);
+    update_accumulator -= step;
+  }
 
-      // Scale into the view
-      projected_points[j].x *= (window_width / 2.0);
-      projected_points[j].y *= (window_height / 2.0);
+  // Draw the mesh where it is between the last two steps
+  float alpha = update_accumulator / step;
+  mesh.rotation =
+      vec3_lerp(previous_state.rotation, current_state.rotation, alpha);
+  mesh.translation =
+      vec3_lerp(previous_state.translation, current_state.translation, alpha);
 
-      // Invert y values to account for flipped screen y coordinates
-      projected_points[j].y *= -1;
+  pipeline_build_frame(&mesh);
+}
 
-      // Translate the projected points to the middle of the screen
-      projected_points[j].x += (window_width / 2.0);
-      projected_points[j].y += (window_height / 2.0);
-    }
+// Print once per second the pipeline counters of the last frame, with the
+// pixels it covered to measure the overdraw
+void report_pipeline_stats(void) {
+  static uint64_t last_report = 0;
+  uint64_t now = SDL_GetPerformanceCounter();
+  if (now - last_report >= SDL_GetPerformanceFrequency()) {
+    last_report = now;
 
-    // Calculate the average depth for each face based on the vertices after
-    // transformation
-    float avg_depth = (transformed_vertices[0].z + transformed_vertices[1].z +
-                       transformed_vertices[2].z) /
-                      3.0;
-
-    // Calculate the shade intensity based on how aligned is the face normal and
-    // the opposite of the light direction
-    float light_intensity_factor = -vec3_dot(normal, light.direction);
-
-    // Calculate the triangle color based on the light angle
-    uint32_t triangle_color =
-        light_apply_intensity(mesh_face.color, light_intensity_factor);
-
-    triangle_t projected_triangle = {
-        .points =
-            {
-                {projected_points[0].x, projected_points[0].y,
-                 projected_points[0].z, projected_points[0].w},
-                {projected_points[1].x, projected_points[1].y,
-                 projected_points[1].z, projected_points[1].w},
-                {projected_points[2].x, projected_points[2].y,
-                 projected_points[2].z, projected_points[2].w},
-            },
-        .texcoords = {{.u = mesh_face.a_uv.u, .v = mesh_face.a_uv.v},
-                      {.u = mesh_face.b_uv.u, .v = mesh_face.b_uv.v},
-                      {.u = mesh_face.c_uv.u, .v = mesh_face.c_uv.v}},
-        .color = triangle_color,
-        .avg_depth = avg_depth};
-
-    // Save the projected triangle in the array of triangles to render
-    array_push(triangles_to_render, projected_triangle);
+    frame_stats.pixels_covered = pipeline_covered_pixels();
+    pipeline_stats_print(&frame_stats);
   }
+}
 
-  // Sort the triangles to render by their avg_depth
-  int num_triangles = array_length(triangles_to_render);
-  for (int i = 0; i < num_triangles; i++) {
-    for (int j = i; j < num_triangles; j++) {
-      if (triangles_to_render[i].avg_depth < triangles_to_render[j].avg_depth) {
-        // Swap the triangles positions in the array
-        triangle_t temp = triangles_to_render[i];
-        triangles_to_render[i] = triangles_to_render[j];
-        triangles_to_render[j] = temp;
-      }
-    }
-  }
+// Rasterize the frame built last, or pipeline_latency frames earlier, into
+// the color buffer. Its render lists were submitted to the job system before
+// this job, so a worker is already building them when it waits
+int draw_frame(void *unused) {
+  (void)unused;
+  pipeline_rasterize();
+  if (show_profile) profile_draw_overlay();
+  return 1;
 }
 
 void render(void) {
-  draw_grid(10);
-
-  // Loop all projected triangles and render them
-  for (int i = 0; i < array_length(triangles_to_render); i++) {
-    triangle_t triangle = triangles_to_render[i];
-
-    if (render_method == RENDER_TEXTURE ||
-        render_method == RENDER_TEXTURE_WIRE) {
-      // Draw textured triangle
-      draw_textured_triangle(
-          triangle.points[0].x, triangle.points[0].y, triangle.points[0].z,
-          triangle.points[0].w, triangle.texcoords[0].u,
-          triangle.texcoords[0].v, triangle.points[1].x, triangle.points[1].y,
-          triangle.points[1].z, triangle.points[1].w, triangle.texcoords[1].u,
-          triangle.texcoords[1].v, triangle.points[2].x, triangle.points[2].y,
-          triangle.points[2].z, triangle.points[2].w, triangle.texcoords[2].u,
-          triangle.texcoords[2].v, mesh_texture);
-    }
-
-    if (render_method == RENDER_FILL_TRIANGLE ||
-        render_method == RENDER_FILL_TRIANGLE_WIRE) {
-      // Draw filled triangle
-      draw_filled_triangle(triangle.points[0].x, triangle.points[0].y,
-                           triangle.points[1].x, triangle.points[1].y,
-                           triangle.points[2].x, triangle.points[2].y,
-                           triangle.color);
-    }
-
-    if (render_method == RENDER_WIRE || render_method == RENDER_WIRE_VERTEX ||
-        render_method == RENDER_FILL_TRIANGLE_WIRE ||
-        render_method == RENDER_TEXTURE_WIRE) {
-      uint32_t line_color = 0XFF00FF00;
+  // The frame is drawn on a worker thread while the previous one is
+  // uploaded and presented, the next one is drawn into the other buffer
+  present_frame(draw_frame);
+  report_pipeline_stats();
 
-      // Draw unfilled triangle
-      draw_triangle(triangle.points[0].x, triangle.points[0].y,
-                    triangle.points[1].x, triangle.points[1].y,
-                    triangle.points[2].x, triangle.points[2].y, line_color);
-    }
+  pipeline_clear();
 
-    if (render_method == RENDER_WIRE_VERTEX) {
-      uint32_t vertex_color = 0XFFFF0000;
-      int vertex_size = 6;
-      // Draw vertex points
-      draw_rect(triangle.points[0].x - 3, triangle.points[0].y - 3, vertex_size,
-                vertex_size, vertex_color);
-      draw_rect(triangle.points[1].x - 3, triangle.points[1].y - 3, vertex_size,
-                vertex_size, vertex_color);
-      draw_rect(triangle.points[2].x - 3, triangle.points[2].y - 3, vertex_size,
-                vertex_size, vertex_color);
-    }
-  }
-
-  // Clear the array of triangles every frame
-  array_free(triangles_to_render);
-  triangles_to_render = NULL;
-
-  render_color_buffer();
-  clear_color_buffer(0xFF000000);
-  SDL_RenderPresent(renderer);
+  if (profile_end_frame()) profile_print();
 }
 
 void free_resources(void) {
-  free(color_buffer);
-  color_buffer = NULL;
+  pipeline_free();
 
   array_free(mesh.vertices);
   mesh.vertices = NULL;
@@ -314,19 +255,52 @@ void free_resources(void) {
   array_free(mesh.faces);
   mesh.faces = NULL;
 
-  upng_free(png_texture);
+  texture_cache_release(mesh.texture);
+  mesh.texture = NULL;
+  texture_cache_free();
+
+  job_system_free();
+  trace_free();
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
+  // -fps N caps the render rate at N frames per second, 0 for no cap.
+  // -latency N builds the geometry N frames ahead on the worker threads.
+  // -buffers 1 draws and presents every frame on the main thread.
+  // -compress stores the textures as BC1/BC3 blocks
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-compress") == 0) compress_textures = true;
+  }
+  for (int i = 1; i + 1 < argc; i++) {
+    if (strcmp(argv[i], "-fps") == 0) max_frame_rate = atoi(argv[i + 1]);
+    if (strcmp(argv[i], "-buffers") == 0) {
+      num_color_buffers = atoi(argv[i + 1]);
+    }
+    if (strcmp(argv[i], "-latency") == 0) {
+      pipeline_latency = atoi(argv[i + 1]);
+      if (pipeline_latency < 0) pipeline_latency = 0;
+      if (pipeline_latency > PIPELINE_MAX_LATENCY) {
+        pipeline_latency = PIPELINE_MAX_LATENCY;
+      }
+    }
+  }
+
   is_running = initialize_window();
   setup();
 
   while (is_running) {
+    trace_zone_t frame_zone = trace_begin("frame");
+    uint64_t input_begin = profile_begin();
     process_input();
+    profile_end(PROFILE_INPUT, input_begin);
     update();
     render();
+    trace_end(frame_zone);
   }
 
+  present_free();
+  dump_trace();
+
   destroy_window();
   free_resources();
 
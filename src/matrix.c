@@ -133,6 +133,12 @@ vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v) {
   // multiply the projection matrix by our original vector
   vec4_t result = mat4_mul_vec4(mat_proj, v);
 
+  return vec4_perspective_divide(result);
+}
+
+// Divide a point in clip space by its w, keeping w (the original z value) for
+// perspective correct interpolation
+vec4_t vec4_perspective_divide(vec4_t result) {
   // perfor, perspective divide with original z_value that is now stored in w
   if (result.w != 0.0) {
     result.x /= result.w;
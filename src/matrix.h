@@ -17,5 +17,6 @@ mat4_t mat4_make_perspective(float fov, float aspect, float znear, float zfar);
 vec4_t mat4_mul_vec4(mat4_t m, vec4_t v);
 mat4_t mat4_mul_mat4(mat4_t a, mat4_t b);
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v);
+vec4_t vec4_perspective_divide(vec4_t v);
 
 #endif
\ No newline at end of file
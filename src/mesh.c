@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "array.h"
+#include "trace.h"
 
 mesh_t mesh = {
     .vertices = NULL,
@@ -13,6 +14,7 @@ mesh_t mesh = {
     .rotation = {.x = 0, .y = 0, .z = 0},
     .scale = {.x = 1.0, .y = 1.0, .z = 1.0},
     .translation = {.x = 0, .y = 0, .z = 0},
+    .texture = NULL,
 };
 
 vec3_t cube_vertices[N_CUBE_VERTICES] = {
@@ -119,18 +121,13 @@ face_t cube_faces[N_CUBE_FACES] = {
      .color = 0xFFFFFFFF}};
 
 void load_cube_mesh_data(void) {
-  for (int i = 0; i < N_CUBE_VERTICES; i++) {
-    vec3_t cube_vertex = cube_vertices[i];
-    array_push(mesh.vertices, cube_vertex);
-  }
-
-  for (int i = 0; i < N_CUBE_FACES; i++) {
-    face_t cube_face = cube_faces[i];
-    array_push(mesh.faces, cube_face);
-  }
+  array_append(mesh.vertices, cube_vertices, N_CUBE_VERTICES);
+  array_append(mesh.faces, cube_faces, N_CUBE_FACES);
 }
 
-void load_obj_file_data(char *filename) {
+// Parse the vertices, texture coordinates and faces of an OBJ file into the
+// mesh. Only the given mesh is touched, so meshes can load on worker threads
+bool load_obj_file_data(mesh_t *mesh, const char *filename) {
   FILE *file;
   char *line = NULL;
   size_t bufsize = 0;  // Initial buffer size
@@ -142,20 +139,38 @@ void load_obj_file_data(char *filename) {
   // Check if the file was opened successfully
   if (file == NULL) {
     fprintf(stderr, "Error opening OBJ file.\n");
-    return;
+    return false;
   }
 
-  // Read the file line by line
+  // Count the elements first, so the arrays are allocated once at their
+  // final size instead of growing while parsing
+  size_t num_vertices = 0;
+  size_t num_texcoords = 0;
+  size_t num_faces = 0;
   while (getline(&line, &bufsize, file) != -1) {
+    if (strncmp(line, "v ", 2) == 0) num_vertices++;
+    if (strncmp(line, "vt ", 3) == 0) num_texcoords++;
+    if (strncmp(line, "f ", 2) == 0) num_faces++;
+  }
+  rewind(file);
+
+  num_vertices += array_length(mesh->vertices);
+  num_faces += array_length(mesh->faces);
+  bool allocated = array_reserve(mesh->vertices, num_vertices) &&
+                   array_reserve(texcoords, num_texcoords) &&
+                   array_reserve(mesh->faces, num_faces);
+
+  // Read the file line by line
+  while (allocated && getline(&line, &bufsize, file) != -1) {
     // Process each line
     if (strncmp(line, "v ", 2) == 0) {  // Vertices
       vec3_t vertex;
       sscanf(line, "v %f %f %f", &vertex.x, &vertex.y, &vertex.z);
-      array_push(mesh.vertices, vertex);
+      allocated = array_push(mesh->vertices, vertex);
     } else if (strncmp(line, "vt ", 3) == 0) {  // Texture coordinates
       tex2_t texcoord;
       sscanf(line, "vt %f %f", &texcoord.u, &texcoord.v);
-      array_push(texcoords, texcoord);
+      allocated = array_push(texcoords, texcoord);
     } else if (strncmp(line, "f ", 2) == 0) {  // Faces
       int vertex_indices[3];
       int texture_indices[3];
@@ -172,7 +187,7 @@ void load_obj_file_data(char *filename) {
                      .b_uv = texcoords[texture_indices[1] - 1],
                      .c_uv = texcoords[texture_indices[2] - 1],
                      .color = 0xFFFFFFFF};
-      array_push(mesh.faces, face);
+      allocated = array_push(mesh->faces, face);
     }
   }
 
@@ -184,4 +199,37 @@ void load_obj_file_data(char *filename) {
 
   // Free the dynamically allocated memory
   free(line);
+
+  if (!allocated) {
+    fprintf(stderr, "Out of memory loading OBJ file.\n");
+  }
+  return allocated;
+}
+
+// Load an OBJ file on a worker thread. The filename must stay valid until
+// the job finished
+typedef struct {
+  mesh_t *mesh;
+  const char *filename;
+} load_obj_request_t;
+
+static int load_obj_job(void *data) {
+  load_obj_request_t *request = (load_obj_request_t *)data;
+  trace_zone_t zone = trace_begin("load_obj");
+  bool loaded = load_obj_file_data(request->mesh, request->filename);
+  trace_end(zone);
+  free(request);
+  return loaded;
+}
+
+job_t *load_obj_file_async(mesh_t *mesh, const char *filename) {
+  load_obj_request_t *request =
+      (load_obj_request_t *)malloc(sizeof(load_obj_request_t));
+  if (request == NULL) return NULL;
+  request->mesh = mesh;
+  request->filename = filename;
+
+  job_t *job = job_submit(load_obj_job, request);
+  if (job == NULL) free(request);
+  return job;
 }
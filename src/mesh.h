@@ -1,11 +1,18 @@
 #ifndef MESH_H
 #define MESH_H
+#include <stdbool.h>
+
+#include "job.h"
+#include "texture.h"
 #include "triangle.h"
 #include "vector.h"
 
 #define N_CUBE_VERTICES 8
 #define N_CUBE_FACES (6 * 2) // 6 cube faces, 2 triangles per face
 
+// Number of consecutive faces grouped in a cluster for occlusion culling
+#define MESH_CLUSTER_FACES 32
+
 extern vec3_t cube_vertices[N_CUBE_VERTICES];
 extern face_t cube_faces[N_CUBE_FACES];
 
@@ -16,11 +23,13 @@ typedef struct {
   vec3_t rotation;    // Rotation with x, y, z values
   vec3_t scale;       // Scale with x, y, z values
   vec3_t translation; // Translation with x, y, z values
+  texture_t *texture; // Texture shared through the texture cache
 } mesh_t;
 
 extern mesh_t mesh;
 
 void load_cube_mesh_data(void);
-void load_obj_file_data(char *filename);
+bool load_obj_file_data(mesh_t *mesh, const char *filename);
+job_t *load_obj_file_async(mesh_t *mesh, const char *filename);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,586 @@
+#include "pipeline.h"
+
+#include <stdlib.h>
+
+#include "array.h"
+#include "display.h"
+#include "hiz.h"
+#include "job.h"
+#include "light.h"
+#include "matrix.h"
+#include "profile.h"
+#include "trace.h"
+#include "triangle.h"
+
+#define PI 3.14159265358979323846264338327950288
+
+// Frames in flight at most: the ones built ahead and the one rasterized
+#define PIPELINE_FRAMES (PIPELINE_MAX_LATENCY + 1)
+
+// Holds the render lists of a frame, reset by pipeline_clear
+#define FRAME_ARENA_SIZE (1024 * 1024)
+
+// Render lists of one frame, from pipeline_build_frame until pipeline_clear.
+// When they are built on a worker thread, everything the geometry reads that
+// may change in the meantime is copied into the frame
+typedef struct {
+  arena_t arena;
+  mesh_t mesh;  // Transform of the mesh when the frame was built
+  enum cull_method cull_method;
+
+  // Array of the projected vertices indexed by the triangles to render
+  raster_vertex_t *raster_vertices;
+
+  // Array of triangles that should be renderer frame by frame
+  triangle_t *triangles_to_render;
+
+  // Array of clusters grouping the triangles to render for occlusion culling
+  cluster_t *clusters_to_render;
+
+  pipeline_stats_t stats;  // Counters of the geometry stages
+  uint64_t stage_ticks[PROFILE_STAGE_COUNT];  // Time of the geometry stages
+  job_t *job;  // Building the render lists, NULL when built or waited for
+} frame_t;
+
+// Ring of the frames in flight, oldest first
+static frame_t frames[PIPELINE_FRAMES];
+static int first_frame = 0;
+static int num_frames = 0;
+
+// Frame being rasterized, from pipeline_rasterize until pipeline_clear
+static frame_t *raster_frame = NULL;
+
+int pipeline_latency = 0;
+
+pipeline_stats_t frame_stats;
+
+// Planes of the view frustum a vertex in clip space is outside of
+enum {
+  FRUSTUM_LEFT = 1 << 0,
+  FRUSTUM_RIGHT = 1 << 1,
+  FRUSTUM_BOTTOM = 1 << 2,
+  FRUSTUM_TOP = 1 << 3,
+  FRUSTUM_NEAR = 1 << 4,
+  FRUSTUM_FAR = 1 << 5
+};
+
+vec3_t camera_position = {.x = 0, .y = 0, .z = 0};
+static mat4_t proj_matrix;
+
+// Allocate the color buffer, the z-buffer and everything else the pipeline
+// needs to render frames of the given size
+bool pipeline_init(int width, int height) {
+  window_width = width;
+  window_height = height;
+
+  // Allocating the required memory in bytes to hold the color buffer
+  color_buffer = (uint32_t *)malloc(sizeof(uint32_t) * width * height);
+
+  // Allocating the z-buffer and the hierarchical depth tiles built on it
+  z_buffer = (float *)malloc(sizeof(float) * width * height);
+
+  // Check if the memory was allocated
+  bool allocated = color_buffer && z_buffer && hiz_init(width, height) &&
+                   overdraw_init(width, height);
+  for (int i = 0; i < PIPELINE_FRAMES; i++) {
+    allocated = allocated && arena_init(&frames[i].arena, FRAME_ARENA_SIZE);
+  }
+  if (!allocated) {
+    pipeline_free();
+    return false;
+  }
+  first_frame = 0;
+  num_frames = 0;
+  raster_frame = NULL;
+  clear_color_buffer(0xFF000000);
+  clear_z_buffer();
+
+  // Initialize the perspective projection matrix
+  float fov = PI / 3.0;  // the same as 160/3 deg but in rad
+  float aspect = (float)height / (float)width;
+  float znear = 0.1;
+  float zfar = 100.0;
+  proj_matrix = mat4_make_perspective(fov, aspect, znear, zfar);
+
+  return true;
+}
+
+static uint8_t frustum_outcode(vec4_t clip_point) {
+  uint8_t outcode = 0;
+  if (clip_point.x < -clip_point.w) outcode |= FRUSTUM_LEFT;
+  if (clip_point.x > clip_point.w) outcode |= FRUSTUM_RIGHT;
+  if (clip_point.y < -clip_point.w) outcode |= FRUSTUM_BOTTOM;
+  if (clip_point.y > clip_point.w) outcode |= FRUSTUM_TOP;
+  if (clip_point.z < 0) outcode |= FRUSTUM_NEAR;
+  if (clip_point.z > clip_point.w) outcode |= FRUSTUM_FAR;
+  return outcode;
+}
+
+// Close the cluster holding the triangles pushed to the render list since
+// `first`, computing the bounds used to test it for occlusion
+static void push_cluster(frame_t *frame, int first) {
+  const triangle_t *triangles = frame->triangles_to_render;
+  int count = array_length(triangles) - first;
+  if (count == 0) return;
+
+  cluster_t cluster = {
+      .first = first,
+      .count = count,
+      .bounds = triangle_bounds(&triangles[first], frame->raster_vertices),
+      .texture = frame->mesh.texture};
+  for (int i = first + 1; i < first + count; i++) {
+    cluster.bounds = bounds_merge(
+        cluster.bounds, triangle_bounds(&triangles[i], frame->raster_vertices));
+  }
+
+  array_push(frame->clusters_to_render, cluster);
+}
+
+// Add the time since begin to a geometry stage of the frame. The profiler
+// belongs to the main thread, so the times are only added to it when the
+// frame is rasterized
+static void frame_stage_end(frame_t *frame, enum profile_stage stage,
+                            uint64_t begin) {
+  uint64_t end = SDL_GetPerformanceCounter();
+  frame->stage_ticks[stage] += end - begin;
+  trace_event(profile_stage_name(stage), begin, end);
+}
+
+// Transform, cull and project the faces of the mesh into the render lists of
+// the frame, sorted for rasterization
+static void build_frame(frame_t *frame) {
+  const mesh_t *mesh = &frame->mesh;
+  pipeline_stats_t cleared = {0};
+  frame->stats = cleared;
+  for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+    frame->stage_ticks[stage] = 0;
+  }
+
+  // Create scale, rotation, and translation matrices that will be used to
+  // multiply the mesh vertices
+  mat4_t scale_matrix =
+      mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
+  mat4_t translation_matrix = mat4_make_translation(
+      mesh->translation.x, mesh->translation.y, mesh->translation.z);
+  mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
+  mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
+  mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
+
+  // Create a World Matrix combining scale, rotation, and translation matrices
+  mat4_t world_matrix = mat4_identity();
+
+  // Order matters: First scale, then rotate, then translate. [T]*[R]*[S]*v
+  world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
+  world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
+  world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
+  world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
+  world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+
+  // Reserve room for every vertex and face in the frame arena, so building
+  // the render lists allocates nothing
+  int num_vertices = array_length(mesh->vertices);
+  int num_faces = array_length(mesh->faces);
+  vec4_t *transformed_vertices = (vec4_t *)arena_alloc(
+      &frame->arena, sizeof(vec4_t) * (num_vertices > 0 ? num_vertices : 1));
+  uint8_t *frustum_outcodes = (uint8_t *)arena_alloc(
+      &frame->arena, sizeof(uint8_t) * (num_vertices > 0 ? num_vertices : 1));
+  frame->raster_vertices =
+      array_arena_new(&frame->arena, num_vertices, sizeof(raster_vertex_t));
+  frame->triangles_to_render =
+      array_arena_new(&frame->arena, num_faces, sizeof(triangle_t));
+  frame->clusters_to_render = array_arena_new(
+      &frame->arena, num_faces / MESH_CLUSTER_FACES + 1, sizeof(cluster_t));
+  if (!transformed_vertices || !frustum_outcodes || !frame->raster_vertices ||
+      !frame->triangles_to_render || !frame->clusters_to_render) {
+    frame->clusters_to_render = NULL;
+    return;
+  }
+
+  // Transform and project every vertex once, the faces sharing a vertex
+  // index its result
+  uint64_t stage_begin = SDL_GetPerformanceCounter();
+  for (int i = 0; i < num_vertices; i++) {
+    vec4_t transformed_vertex = vec4_from_vec3(mesh->vertices[i]);
+
+    // Multiply the world matrix by the original vector
+    transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
+
+    // Save transformed vertex in the array of transformed vertices
+    transformed_vertices[i] = transformed_vertex;
+  }
+  frame_stage_end(frame, PROFILE_TRANSFORM, stage_begin);
+
+  stage_begin = SDL_GetPerformanceCounter();
+  for (int i = 0; i < num_vertices; i++) {
+    // Project the current vertex, finding the frustum planes it is outside
+    // of before the perspective divide
+    vec4_t clip_point = mat4_mul_vec4(proj_matrix, transformed_vertices[i]);
+    frustum_outcodes[i] = frustum_outcode(clip_point);
+    vec4_t projected_point = vec4_perspective_divide(clip_point);
+
+    // Scale into the view
+    projected_point.x *= (window_width / 2.0);
+    projected_point.y *= (window_height / 2.0);
+
+    // Invert y values to account for flipped screen y coordinates
+    projected_point.y *= -1;
+
+    // Translate the projected points to the middle of the screen
+    projected_point.x += (window_width / 2.0);
+    projected_point.y += (window_height / 2.0);
+
+    raster_vertex_t raster_vertex = {.x = projected_point.x,
+                                     .y = projected_point.y,
+                                     .inv_w = 1 / projected_point.w};
+    array_push(frame->raster_vertices, raster_vertex);
+  }
+  frame_stage_end(frame, PROFILE_PROJECT, stage_begin);
+
+  // Loop all triangle faces of our mesh
+  stage_begin = SDL_GetPerformanceCounter();
+  pipeline_stats_t geometry_stats = {0};
+  int cluster_first = 0;
+  for (int i = 0; i < num_faces; i++) {
+    // Every MESH_CLUSTER_FACES faces the previous cluster is closed
+    if (i > 0 && i % MESH_CLUSTER_FACES == 0) {
+      push_cluster(frame, cluster_first);
+      cluster_first = array_length(frame->triangles_to_render);
+    }
+
+    face_t mesh_face = mesh->faces[i];
+    geometry_stats.faces++;
+
+    // Get individual vectors from A, B, and C vertices to compute normal
+    vec3_t vector_a =
+        vec3_from_vec4(transformed_vertices[mesh_face.a]); /*   A   */
+    vec3_t vector_b =
+        vec3_from_vec4(transformed_vertices[mesh_face.b]); /*  / \  */
+    vec3_t vector_c =
+        vec3_from_vec4(transformed_vertices[mesh_face.c]); /* C---B */
+
+    // Get the vector subtraction of B-A and C-A
+    vec3_t vector_ab = vec3_sub(vector_b, vector_a);
+    vec3_t vector_ac = vec3_sub(vector_c, vector_a);
+    vec3_normalize(&vector_ab);
+    vec3_normalize(&vector_ac);
+
+    // Compute the face normal (using cross product to find perpendicular)
+    vec3_t normal = vec3_cross(vector_ab, vector_ac);
+    vec3_normalize(&normal);
+
+    // Find the vector between vertex A in the triangle and the camera origin
+    vec3_t camera_ray = vec3_sub(camera_position, vector_a);
+
+    // Calculate how aligned the camera ray is with the face normal (using dot
+    // product)
+    float dot_normal_camera = vec3_dot(normal, camera_ray);
+
+    // Backface culling test to see if the current face should be projected
+    if (frame->cull_method == CULL_BACKFACE) {
+      // Backface culling, bypassing triangles that are looking away from the
+      // camera
+      if (dot_normal_camera < 0) {
+        geometry_stats.backface_culled++;
+        continue;
+      }
+    }
+
+    // Cull the faces entirely outside one plane of the frustum. The faces
+    // crossing a plane are kept, the rasterizers clip them to the screen
+    uint8_t outcode_a = frustum_outcodes[mesh_face.a];
+    uint8_t outcode_b = frustum_outcodes[mesh_face.b];
+    uint8_t outcode_c = frustum_outcodes[mesh_face.c];
+    if (outcode_a & outcode_b & outcode_c) {
+      geometry_stats.frustum_culled++;
+      continue;
+    }
+    if (outcode_a | outcode_b | outcode_c) geometry_stats.clipped++;
+
+    // Calculate the average depth for each face based on the vertices after
+    // transformation
+    float avg_depth = (vector_a.z + vector_b.z + vector_c.z) / 3.0;
+
+    // Calculate the shade intensity based on how aligned is the face normal and
+    // the opposite of the light direction
+    float light_intensity_factor = -vec3_dot(normal, light.direction);
+
+    // Calculate the triangle color based on the light angle
+    uint32_t triangle_color =
+        light_apply_intensity(mesh_face.color, light_intensity_factor);
+
+    triangle_t projected_triangle = {
+        .vertices = {mesh_face.a, mesh_face.b, mesh_face.c},
+        .color = triangle_color,
+        .avg_depth = avg_depth};
+    tex2_t uvs[3] = {mesh_face.a_uv, mesh_face.b_uv, mesh_face.c_uv};
+    triangle_setup(&projected_triangle, frame->raster_vertices, uvs,
+                   mesh->texture);
+
+    // Save the projected triangle in the array of triangles to render
+    array_push(frame->triangles_to_render, projected_triangle);
+  }
+
+  push_cluster(frame, cluster_first);
+  pipeline_stats_add(&frame->stats, &geometry_stats);
+  frame_stage_end(frame, PROFILE_CULL, stage_begin);
+
+  // Sort the triangles of each cluster front-to-back by their avg_depth
+  stage_begin = SDL_GetPerformanceCounter();
+  triangle_t *triangles = frame->triangles_to_render;
+  cluster_t *clusters = frame->clusters_to_render;
+  int num_clusters = array_length(clusters);
+  for (int c = 0; c < num_clusters; c++) {
+    int first = clusters[c].first;
+    int last = first + clusters[c].count;
+    for (int i = first; i < last; i++) {
+      for (int j = i; j < last; j++) {
+        if (triangles[i].avg_depth > triangles[j].avg_depth) {
+          // Swap the triangles positions in the array
+          triangle_t temp = triangles[i];
+          triangles[i] = triangles[j];
+          triangles[j] = temp;
+        }
+      }
+    }
+  }
+
+  // Sort the clusters front-to-back by their nearest depth
+  for (int i = 0; i < num_clusters; i++) {
+    for (int j = i; j < num_clusters; j++) {
+      if (clusters[i].bounds.min_depth > clusters[j].bounds.min_depth) {
+        // Swap the clusters positions in the array
+        cluster_t temp = clusters[i];
+        clusters[i] = clusters[j];
+        clusters[j] = temp;
+      }
+    }
+  }
+  frame_stage_end(frame, PROFILE_SORT, stage_begin);
+}
+
+static int build_frame_job(void *data) {
+  build_frame((frame_t *)data);
+  return 1;
+}
+
+// Wait until the render lists of the frame are built
+static void wait_for_frame(frame_t *frame) {
+  if (frame->job == NULL) return;
+
+  trace_zone_t zone = trace_begin("wait_geometry");
+  job_wait(frame->job);
+  frame->job = NULL;
+  trace_end(zone);
+}
+
+// Drop the oldest frame in flight without rasterizing it
+static void drop_oldest_frame(void) {
+  frame_t *frame = &frames[first_frame];
+  wait_for_frame(frame);
+  arena_reset(&frame->arena);
+  if (raster_frame == frame) raster_frame = NULL;
+
+  first_frame = (first_frame + 1) % PIPELINE_FRAMES;
+  num_frames--;
+}
+
+// Start building the render lists of a frame for the mesh as it is now. With
+// a pipeline_latency above 0 they are built on a worker thread, while the
+// caller goes on to rasterize a frame built earlier
+void pipeline_build_frame(const mesh_t *mesh) {
+  // Make room when frames were built without being rasterized
+  if (num_frames == PIPELINE_FRAMES) drop_oldest_frame();
+
+  frame_t *frame = &frames[(first_frame + num_frames) % PIPELINE_FRAMES];
+  num_frames++;
+  frame->mesh = *mesh;
+  frame->cull_method = cull_method;
+  frame->job = NULL;
+
+  if (pipeline_latency > 0) {
+    frame->job = job_submit(build_frame_job, frame);
+    if (frame->job) return;
+  }
+  build_frame(frame);
+}
+
+static void render_triangle(const frame_t *frame, const triangle_t *triangle,
+                            const texture_t *texture,
+                            texture_block_cache_t *block_cache) {
+  const raster_vertex_t *raster_vertices = frame->raster_vertices;
+
+  if (render_method == RENDER_TEXTURE ||
+      render_method == RENDER_TEXTURE_WIRE ||
+      render_method == RENDER_TEXTURE_PREPASS) {
+    // Draw textured triangle
+    draw_textured_triangle(triangle, raster_vertices, texture, block_cache,
+                           &frame_stats);
+  }
+
+  if (render_method == RENDER_FILL_TRIANGLE ||
+      render_method == RENDER_FILL_TRIANGLE_WIRE) {
+    // Draw filled triangle
+    draw_filled_triangle(triangle, raster_vertices, &frame_stats);
+  }
+
+  const raster_vertex_t *a = &raster_vertices[triangle->vertices[0]];
+  const raster_vertex_t *b = &raster_vertices[triangle->vertices[1]];
+  const raster_vertex_t *c = &raster_vertices[triangle->vertices[2]];
+
+  if (render_method == RENDER_WIRE || render_method == RENDER_WIRE_VERTEX ||
+      render_method == RENDER_FILL_TRIANGLE_WIRE ||
+      render_method == RENDER_TEXTURE_WIRE) {
+    uint32_t line_color = 0XFF00FF00;
+
+    // Draw unfilled triangle
+    draw_triangle(a->x, a->y, b->x, b->y, c->x, c->y, line_color);
+  }
+
+  if (render_method == RENDER_WIRE_VERTEX) {
+    uint32_t vertex_color = 0XFFFF0000;
+    int vertex_size = 6;
+    // Draw vertex points
+    draw_rect(a->x - 3, a->y - 3, vertex_size, vertex_size, vertex_color);
+    draw_rect(b->x - 3, b->y - 3, vertex_size, vertex_size, vertex_color);
+    draw_rect(c->x - 3, c->y - 3, vertex_size, vertex_size, vertex_color);
+  }
+}
+
+// Render all clusters of projected triangles, front-to-back testing them
+// against the hierarchical z-buffer or back-to-front for the painter's
+// algorithm. The blocks of compressed textures decoded for a triangle are
+// kept for the next ones, by the thread rasterizing them
+static void render_clusters(const frame_t *frame, bool front_to_back) {
+  trace_zone_t zone = trace_begin("render_clusters");
+  texture_block_cache_t block_cache;
+  block_cache.texture = NULL;  // Cleared by the first compressed texture
+
+  int num_clusters = array_length(frame->clusters_to_render);
+  for (int c = 0; c < num_clusters; c++) {
+    cluster_t cluster =
+        frame->clusters_to_render[front_to_back ? c : num_clusters - 1 - c];
+
+    if (front_to_back && hiz_is_occluded(cluster.bounds.min_x,
+                                         cluster.bounds.min_y,
+                                         cluster.bounds.max_x,
+                                         cluster.bounds.max_y,
+                                         cluster.bounds.min_depth)) {
+      continue;
+    }
+
+    for (int k = 0; k < cluster.count; k++) {
+      int i = cluster.first + (front_to_back ? k : cluster.count - 1 - k);
+      const triangle_t *triangle = &frame->triangles_to_render[i];
+      bounds_t bounds = triangle_bounds(triangle, frame->raster_vertices);
+
+      if (front_to_back &&
+          hiz_is_occluded(bounds.min_x, bounds.min_y, bounds.max_x,
+                          bounds.max_y, bounds.min_depth)) {
+        continue;
+      }
+
+      render_triangle(frame, triangle, cluster.texture, &block_cache);
+
+      // Refresh the depth tiles covered by the triangle just rasterized
+      if (front_to_back && depth_mode != DEPTH_EQUAL) {
+        hiz_update(bounds.min_x, bounds.min_y, bounds.max_x, bounds.max_y);
+      }
+    }
+  }
+  trace_end(zone);
+}
+
+// Take the frame built pipeline_latency calls of pipeline_build_frame ago,
+// waiting for its render lists. Returns NULL while the pipeline fills up
+static frame_t *take_raster_frame(void) {
+  // Frames built ahead of a latency that was lowered are dropped
+  while (num_frames > pipeline_latency + 1) drop_oldest_frame();
+  if (num_frames <= pipeline_latency || raster_frame) return NULL;
+
+  frame_t *frame = &frames[first_frame];
+  wait_for_frame(frame);
+  for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+    profile_add(stage, frame->stage_ticks[stage]);
+  }
+  return frame;
+}
+
+// Rasterize the render lists of the frame into the color buffer
+void pipeline_rasterize(void) {
+  raster_frame = take_raster_frame();
+  pipeline_stats_t cleared = {0};
+  frame_stats = raster_frame ? raster_frame->stats : cleared;
+
+  uint64_t stage_begin = profile_begin();
+  draw_grid(10);
+
+  if (raster_frame == NULL || raster_frame->clusters_to_render == NULL) {
+    // Nothing to draw yet
+  } else if (render_method == RENDER_TEXTURE_PREPASS) {
+    // Lay down the depth of all visible triangles first, then texture each
+    // pixel only once with the triangle whose depth ended in the z-buffer
+    depth_mode = DEPTH_ONLY;
+    render_clusters(raster_frame, true);
+    depth_mode = DEPTH_EQUAL;
+    render_clusters(raster_frame, true);
+    depth_mode = DEPTH_LESS;
+  } else {
+    // Wireframes are not depth tested, so the modes drawing them keep the
+    // back-to-front order of the painter's algorithm. The solid modes draw
+    // front-to-back so hidden geometry is rejected by the hierarchical
+    // z-buffer
+    render_clusters(raster_frame, render_method == RENDER_FILL_TRIANGLE ||
+                                      render_method == RENDER_TEXTURE);
+  }
+
+  profile_end(PROFILE_RASTER, stage_begin);
+
+  if (show_overdraw) draw_overdraw_heat_map();
+}
+
+// Pixels the last frame covered, to measure its overdraw
+unsigned long pipeline_covered_pixels(void) {
+  unsigned long covered_pixels = 0;
+  for (int i = 0; i < window_width * window_height; i++) {
+    if (z_buffer[i] < 1.0) covered_pixels++;
+  }
+  return covered_pixels;
+}
+
+// Clear the render lists and the buffers of the frame once it is displayed
+void pipeline_clear(void) {
+  // Clear the arrays of triangles and clusters every frame, keeping the
+  // memory of the arena for the next one
+  if (raster_frame) {
+    arena_reset(&raster_frame->arena);
+    raster_frame = NULL;
+    first_frame = (first_frame + 1) % PIPELINE_FRAMES;
+    num_frames--;
+  }
+
+  uint64_t stage_begin = profile_begin();
+  clear_color_buffer(0xFF000000);
+  clear_z_buffer();
+  hiz_clear();
+  profile_end(PROFILE_CLEAR, stage_begin);
+}
+
+// Wait for the frames built ahead and drop them, when the mesh they use is
+// about to change or be freed
+void pipeline_flush(void) {
+  raster_frame = NULL;
+  while (num_frames > 0) drop_oldest_frame();
+}
+
+void pipeline_free(void) {
+  pipeline_flush();
+  for (int i = 0; i < PIPELINE_FRAMES; i++) arena_free(&frames[i].arena);
+
+  free(color_buffer);
+  color_buffer = NULL;
+
+  free(z_buffer);
+  z_buffer = NULL;
+  hiz_free();
+  overdraw_free();
+}
@@ -0,0 +1,33 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdbool.h>
+
+#include "mesh.h"
+#include "stats.h"
+#include "vector.h"
+
+// Most frames the geometry can run ahead of the rasterization
+#define PIPELINE_MAX_LATENCY 2
+
+// Frames the geometry runs ahead of the rasterization. At 0 every frame is
+// built and rasterized on the calling thread. Above 0 the render lists are
+// built on the worker threads of the job system, and pipeline_rasterize
+// draws the frame built that many calls of pipeline_build_frame earlier
+extern int pipeline_latency;
+
+// Counters of the frame rasterized, from pipeline_rasterize until the next
+// one starts
+extern pipeline_stats_t frame_stats;
+
+extern vec3_t camera_position;
+
+bool pipeline_init(int width, int height);
+void pipeline_build_frame(const mesh_t *mesh);
+void pipeline_rasterize(void);
+unsigned long pipeline_covered_pixels(void);
+void pipeline_clear(void);
+void pipeline_flush(void);
+void pipeline_free(void);
+
+#endif
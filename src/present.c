@@ -0,0 +1,89 @@
+#include "present.h"
+
+#include <SDL2/SDL.h>
+#include <stdlib.h>
+
+#include "display.h"
+#include "profile.h"
+#include "trace.h"
+
+// Color buffers the frames are drawn into in turn, the first one is the
+// buffer allocated by the pipeline. Every other buffer is owned by this module
+static uint32_t *buffers[PRESENT_MAX_BUFFERS];
+static int num_buffers = 0;
+
+// Buffer of the frame drawn last, presented while the next one is drawn
+static uint32_t *drawn_buffer = NULL;
+
+// Use num_buffers color buffers, so a frame is drawn on a worker thread
+// while the previous one is uploaded and presented. With one buffer, or if
+// the second one can not be allocated, every frame is drawn and then
+// presented on the calling thread
+bool present_init(int num_buffers_requested) {
+  present_free();
+
+  if (num_buffers_requested > PRESENT_MAX_BUFFERS) {
+    num_buffers_requested = PRESENT_MAX_BUFFERS;
+  }
+  if (num_buffers_requested < 2) return true;
+
+  buffers[0] = color_buffer;
+  num_buffers = 1;
+  for (int i = 1; i < num_buffers_requested; i++) {
+    buffers[i] = (uint32_t *)malloc(sizeof(uint32_t) * window_width *
+                                    window_height);
+    if (buffers[i] == NULL) break;
+    num_buffers++;
+  }
+  if (num_buffers < 2) {
+    present_free();
+    return false;
+  }
+  return true;
+}
+
+static void present_buffer(const uint32_t *buffer) {
+  trace_zone_t zone = trace_begin("present");
+  render_color_buffer(buffer);
+  SDL_RenderPresent(renderer);
+  trace_end(zone);
+}
+
+// Draw a frame into the color buffer with draw_frame and present it. With
+// more than one buffer, draw_frame runs as a job on a worker thread while
+// the frame drawn by the previous call is presented here, and the next frame
+// is drawn into the following buffer. The renderer is only used from the
+// calling thread, and draw_frame must not touch what the caller changes
+// until present_frame returns
+void present_frame(job_function_t draw_frame) {
+  job_t *draw_job = num_buffers > 1 ? job_submit(draw_frame, NULL) : NULL;
+  if (draw_job == NULL) draw_frame(NULL);
+
+  uint64_t stage_begin = profile_begin();
+  if (num_buffers < 2) {
+    present_buffer(color_buffer);
+  } else if (drawn_buffer) {
+    present_buffer(drawn_buffer);
+  }
+  uint64_t present_ticks = profile_begin() - stage_begin;
+
+  // The stage timings are only added once the job is done with them
+  if (draw_job) job_wait(draw_job);
+  profile_add(PROFILE_PRESENT, present_ticks);
+
+  if (num_buffers > 1) {
+    int next = 0;
+    while (buffers[next] != color_buffer) next++;
+    drawn_buffer = color_buffer;
+    color_buffer = buffers[(next + 1) % num_buffers];
+  }
+}
+
+// Give the pipeline back its own color buffer, the frame drawn last is not
+// presented
+void present_free(void) {
+  if (num_buffers > 0) color_buffer = buffers[0];
+  for (int i = 1; i < num_buffers; i++) free(buffers[i]);
+  num_buffers = 0;
+  drawn_buffer = NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef PRESENT_H
+#define PRESENT_H
+
+#include <stdbool.h>
+
+#include "job.h"
+
+// Most color buffers the frames are drawn into in turn, one drawn while the
+// other is presented
+#define PRESENT_MAX_BUFFERS 2
+
+bool present_init(int num_buffers);
+void present_frame(job_function_t draw_frame);
+void present_free(void);
+
+#endif
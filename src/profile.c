@@ -0,0 +1,145 @@
+#include "profile.h"
+
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "display.h"
+#include "trace.h"
+
+// Layout of the overlay: one bar per stage, as long as its average time at
+// OVERLAY_PIXELS_PER_MS, with a tick at its 99th percentile
+#define OVERLAY_X 10
+#define OVERLAY_Y 10
+#define OVERLAY_BAR_HEIGHT 6
+#define OVERLAY_BAR_SPACING 3
+#define OVERLAY_PIXELS_PER_MS 20
+
+bool show_profile = false;
+
+static const char *stage_names[PROFILE_STAGE_COUNT] = {
+    "input", "transform", "project", "cull",
+    "sort",  "raster",    "present", "clear"};
+
+static const uint32_t stage_colors[PROFILE_STAGE_COUNT] = {
+    0xFF808080, 0xFF4080FF, 0xFF40C0FF, 0xFF40FFC0,
+    0xFFC0FF40, 0xFFFF4040, 0xFFFF40C0, 0xFFC040FF};
+
+static uint64_t ticks_per_ms = 1;
+
+// Time spent in each stage by the current frame, a stage may be entered more
+// than once per frame
+static uint64_t frame_ticks[PROFILE_STAGE_COUNT];
+
+// Milliseconds spent in each stage by the last PROFILE_WINDOW_FRAMES frames,
+// as a ring starting at the oldest frame once it is full
+static float samples[PROFILE_STAGE_COUNT][PROFILE_WINDOW_FRAMES];
+static int num_samples = 0;
+static int next_sample = 0;
+
+void profile_init(void) {
+  ticks_per_ms = SDL_GetPerformanceFrequency() / 1000;
+  if (ticks_per_ms == 0) ticks_per_ms = 1;
+
+  for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+    frame_ticks[stage] = 0;
+  }
+  num_samples = 0;
+  next_sample = 0;
+}
+
+// Read the monotonic high resolution clock at the start of a stage
+uint64_t profile_begin(void) { return SDL_GetPerformanceCounter(); }
+
+// Add the time since begin to the stage, and record it in the trace
+void profile_end(enum profile_stage stage, uint64_t begin) {
+  uint64_t end = SDL_GetPerformanceCounter();
+  frame_ticks[stage] += end - begin;
+  trace_event(stage_names[stage], begin, end);
+}
+
+// Add time measured on another thread to the stage, it is already traced
+void profile_add(enum profile_stage stage, uint64_t ticks) {
+  frame_ticks[stage] += ticks;
+}
+
+static int compare_floats(const void *a, const void *b) {
+  float x = *(const float *)a;
+  float y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+const char *profile_stage_name(enum profile_stage stage) {
+  return stage_names[stage];
+}
+
+// Milliseconds the stage took in the last frame ended
+float profile_last_frame(enum profile_stage stage) {
+  if (num_samples == 0) return 0;
+  int last = (next_sample + PROFILE_WINDOW_FRAMES - 1) % PROFILE_WINDOW_FRAMES;
+  return samples[stage][last];
+}
+
+profile_stats_t profile_stats(enum profile_stage stage) {
+  profile_stats_t stats = {.min = 0, .avg = 0, .p99 = 0};
+  if (num_samples == 0) return stats;
+
+  float sorted[PROFILE_WINDOW_FRAMES];
+  float sum = 0;
+  for (int i = 0; i < num_samples; i++) {
+    sorted[i] = samples[stage][i];
+    sum += sorted[i];
+  }
+  qsort(sorted, num_samples, sizeof(float), compare_floats);
+
+  // Nearest rank: the smallest sample at least 99% of the samples are under
+  int rank = (num_samples * 99 + 99) / 100;
+  stats.min = sorted[0];
+  stats.avg = sum / num_samples;
+  stats.p99 = sorted[rank - 1];
+  return stats;
+}
+
+void profile_print(void) {
+  printf("%-10s %8s %8s %8s  (ms over %d frames)\n", "stage", "min", "avg",
+         "p99", num_samples);
+  float total = 0;
+  for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+    profile_stats_t stats = profile_stats(stage);
+    printf("%-10s %8.3f %8.3f %8.3f\n", stage_names[stage], stats.min,
+           stats.avg, stats.p99);
+    total += stats.avg;
+  }
+  printf("%-10s %17.3f\n", "total", total);
+}
+
+// Record the stage times of the frame that just ended. Returns true every
+// time the window has been refilled, when the statistics are worth printing
+bool profile_end_frame(void) {
+  for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+    samples[stage][next_sample] = (float)frame_ticks[stage] / ticks_per_ms;
+    frame_ticks[stage] = 0;
+  }
+  if (num_samples < PROFILE_WINDOW_FRAMES) num_samples++;
+  next_sample = (next_sample + 1) % PROFILE_WINDOW_FRAMES;
+
+  return next_sample == 0;
+}
+
+// Draw the average and 99th percentile time of every stage over the color
+// buffer, with a vertical line at the frame budget
+void profile_draw_overlay(void) {
+  int height = PROFILE_STAGE_COUNT * (OVERLAY_BAR_HEIGHT + OVERLAY_BAR_SPACING);
+  for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+    profile_stats_t stats = profile_stats(stage);
+    int y = OVERLAY_Y + stage * (OVERLAY_BAR_HEIGHT + OVERLAY_BAR_SPACING);
+    int avg_width = stats.avg * OVERLAY_PIXELS_PER_MS + 1;
+    int p99_x = OVERLAY_X + stats.p99 * OVERLAY_PIXELS_PER_MS;
+
+    draw_rect(OVERLAY_X, y, avg_width, OVERLAY_BAR_HEIGHT, stage_colors[stage]);
+    draw_rect(p99_x, y, 2, OVERLAY_BAR_HEIGHT, 0xFFFFFFFF);
+  }
+
+  int budget_x = OVERLAY_X + FRAME_TARGET_TIME * OVERLAY_PIXELS_PER_MS;
+  draw_rect(budget_x, OVERLAY_Y, 1, height, 0xFFFFFF00);
+}
@@ -0,0 +1,44 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of frames the rolling statistics are computed over, and how often
+// they are printed
+#define PROFILE_WINDOW_FRAMES 120
+
+// Stages of a frame, in the order they run
+enum profile_stage {
+  PROFILE_INPUT,      // process_input
+  PROFILE_TRANSFORM,  // World transform of the mesh vertices
+  PROFILE_PROJECT,    // Projection of the vertices to the screen
+  PROFILE_CULL,       // Backface culling, shading and setup of the faces
+  PROFILE_SORT,       // Depth sort of the triangles and clusters
+  PROFILE_RASTER,     // Rasterization of the clusters
+  PROFILE_PRESENT,    // Upload and present of the color buffer
+  PROFILE_CLEAR,      // Clear of the color, depth and hierarchical buffers
+  PROFILE_STAGE_COUNT
+};
+
+// Rolling statistics of a stage in milliseconds
+typedef struct {
+  float min;
+  float avg;
+  float p99;
+} profile_stats_t;
+
+extern bool show_profile;
+
+void profile_init(void);
+uint64_t profile_begin(void);
+void profile_end(enum profile_stage stage, uint64_t begin);
+void profile_add(enum profile_stage stage, uint64_t ticks);
+bool profile_end_frame(void);
+float profile_last_frame(enum profile_stage stage);
+profile_stats_t profile_stats(enum profile_stage stage);
+const char *profile_stage_name(enum profile_stage stage);
+void profile_print(void);
+void profile_draw_overlay(void);
+
+#endif
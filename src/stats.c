@@ -0,0 +1,83 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "display.h"
+
+bool show_overdraw = false;
+uint8_t *overdraw_buffer = NULL;
+
+static int overdraw_width = 0;
+static int overdraw_height = 0;
+
+// Heat map colors for pixels shaded 0, 1, 2... times, the last one is used
+// for any higher count
+static const uint32_t heat_colors[] = {0xFF000000, 0xFF0000A0, 0xFF00A000,
+                                       0xFFE0E000, 0xFFFF8000, 0xFFFF0000,
+                                       0xFFFFFFFF};
+#define NUM_HEAT_COLORS (int)(sizeof(heat_colors) / sizeof(heat_colors[0]))
+
+void pipeline_stats_add(pipeline_stats_t *total,
+                        const pipeline_stats_t *part) {
+  total->faces += part->faces;
+  total->backface_culled += part->backface_culled;
+  total->frustum_culled += part->frustum_culled;
+  total->clipped += part->clipped;
+  total->triangles_rasterized += part->triangles_rasterized;
+  total->depth_writes += part->depth_writes;
+  total->pixels_written += part->pixels_written;
+  total->texels_fetched += part->texels_fetched;
+  total->pixels_covered += part->pixels_covered;
+}
+
+// Print the counters of a frame, with the overdraw as the pixels shaded per
+// pixel covered and the draw_texel calls the depth pre-pass saved
+void pipeline_stats_print(const pipeline_stats_t *stats) {
+  float overdraw = 0;
+  if (stats->pixels_covered > 0) {
+    overdraw = (float)stats->pixels_written / stats->pixels_covered;
+  }
+
+  // Without a pre-pass every pixel that passes the depth test is shaded
+  long saved = 0;
+  if (render_method == RENDER_TEXTURE_PREPASS) {
+    saved = (long)stats->depth_writes - (long)stats->pixels_written;
+  }
+
+  printf("faces: %lu, backface culled: %lu, frustum culled: %lu, "
+         "clipped: %lu, rasterized: %lu\n",
+         stats->faces, stats->backface_culled, stats->frustum_culled,
+         stats->clipped, stats->triangles_rasterized);
+  printf("depth writes: %lu, pixels written: %lu, texels fetched: %lu, "
+         "pixels covered: %lu, overdraw: %.2f, draw_texel calls saved: %ld\n",
+         stats->depth_writes, stats->pixels_written, stats->texels_fetched,
+         stats->pixels_covered, overdraw, saved);
+}
+
+bool overdraw_init(int width, int height) {
+  overdraw_buffer = (uint8_t *)calloc((size_t)width * height, sizeof(uint8_t));
+  overdraw_width = overdraw_buffer ? width : 0;
+  overdraw_height = overdraw_buffer ? height : 0;
+  return overdraw_buffer != NULL;
+}
+
+// Replace the color buffer with the times each pixel was shaded, and reset
+// the counts for the next frame
+void draw_overdraw_heat_map(void) {
+  for (int y = 0; y < overdraw_height; y++) {
+    for (int x = 0; x < overdraw_width; x++) {
+      uint8_t *count = &overdraw_buffer[overdraw_width * y + x];
+      int color = *count < NUM_HEAT_COLORS ? *count : NUM_HEAT_COLORS - 1;
+      draw_pixel(x, y, heat_colors[color]);
+      *count = 0;
+    }
+  }
+}
+
+void overdraw_free(void) {
+  free(overdraw_buffer);
+  overdraw_buffer = NULL;
+  overdraw_width = 0;
+  overdraw_height = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Work done by each stage of the pipeline in a frame, to tell whether it is
+// bound by geometry or by fill. Every thread counts into its own copy, which
+// is added to the frame totals once its work is done
+typedef struct {
+  unsigned long faces;                 // Faces of the mesh processed
+  unsigned long backface_culled;       // Faces looking away from the camera
+  unsigned long frustum_culled;        // Faces outside a plane of the frustum
+  unsigned long clipped;               // Faces crossing a plane of the frustum
+  unsigned long triangles_rasterized;  // Triangles drawn by the rasterizers
+  unsigned long depth_writes;          // Pixels that passed the depth test
+  unsigned long pixels_written;        // Pixels shaded
+  unsigned long texels_fetched;        // Texels read by the samplers
+  unsigned long pixels_covered;        // Pixels covered by the frame
+} pipeline_stats_t;
+
+// Times each pixel was shaded in the current frame, only counted while the
+// overdraw heat map is shown
+extern bool show_overdraw;
+extern uint8_t *overdraw_buffer;
+
+void pipeline_stats_add(pipeline_stats_t *total, const pipeline_stats_t *part);
+void pipeline_stats_print(const pipeline_stats_t *stats);
+
+bool overdraw_init(int width, int height);
+void draw_overdraw_heat_map(void);
+void overdraw_free(void);
+
+#endif
@@ -1,32 +1,494 @@
 #include "texture.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-int texture_width = 64;
-int texture_height = 64;
+#include "texture_block.h"
 
-upng_t *png_texture = NULL;
-uint32_t *mesh_texture = NULL;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-void load_png_texture_data(char *filename) {
-  png_texture = upng_new_from_file(filename);
+enum texture_filter texture_filter = FILTER_NEAREST;
+bool compress_textures = false;
 
-  if (png_texture != NULL) {
-    upng_decode(png_texture);
+mipmap_t make_mipmap(uint32_t *texels, int width, int height,
+                     enum texture_layout layout) {
+  mipmap_t mipmap = {
+      .texels = texels,
+      .width = width,
+      .height = height,
+      .tiles_per_row = (width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE,
+      .layout = layout,
+      .is_power_of_two =
+          (width & (width - 1)) == 0 && (height & (height - 1)) == 0,
+      .width_mask = width - 1,
+      .height_mask = height - 1,
+      .u_scale = width,
+      .v_scale = height};
+  return mipmap;
+}
+
+// Average the four ARGB texels of a 2x2 block, channel by channel
+uint32_t average_texels(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3) {
+  uint32_t result = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t sum = ((c0 >> shift) & 0xFF) + ((c1 >> shift) & 0xFF) +
+                   ((c2 >> shift) & 0xFF) + ((c3 >> shift) & 0xFF);
+    result |= ((sum + 2) / 4) << shift;
+  }
+  return result;
+}
+
+// Build the mip chain of a texture whose level 0 is already set, where every
+// other level is downsampled from the previous one with a 2x2 box filter
+// until reaching a single texel. All levels are linear
+bool build_mipmaps(texture_t *texture) {
+  while (texture->num_mipmaps < MAX_MIPMAP_LEVELS) {
+    mipmap_t *src = &texture->mipmaps[texture->num_mipmaps - 1];
+    if (src->width == 1 && src->height == 1) break;
+
+    int width = src->width > 1 ? src->width / 2 : 1;
+    int height = src->height > 1 ? src->height / 2 : 1;
+    uint32_t *texels = (uint32_t *)malloc(sizeof(uint32_t) * width * height);
+    if (!texels) return false;
+
+    for (int y = 0; y < height; y++) {
+      // Odd sizes clamp the second row/column of the block to the edge
+      int y0 = y * 2;
+      int y1 = y0 + 1 < src->height ? y0 + 1 : y0;
+      for (int x = 0; x < width; x++) {
+        int x0 = x * 2;
+        int x1 = x0 + 1 < src->width ? x0 + 1 : x0;
+        texels[width * y + x] =
+            average_texels(src->texels[src->width * y0 + x0],
+                           src->texels[src->width * y0 + x1],
+                           src->texels[src->width * y1 + x0],
+                           src->texels[src->width * y1 + x1]);
+      }
+    }
+
+    texture->mipmaps[texture->num_mipmaps++] =
+        make_mipmap(texels, width, height, TEXTURE_LAYOUT_LINEAR);
+  }
+
+  return true;
+}
+
+int mipmap_offset(const mipmap_t *mipmap, int x, int y) {
+  if (mipmap->layout == TEXTURE_LAYOUT_TILED) {
+    int tile = mipmap->tiles_per_row * (y >> TEXTURE_TILE_SHIFT) +
+               (x >> TEXTURE_TILE_SHIFT);
+    return (tile << (2 * TEXTURE_TILE_SHIFT)) +
+           ((y & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_SHIFT) +
+           (x & (TEXTURE_TILE_SIZE - 1));
+  }
+  return mipmap->width * y + x;
+}
+
+// Allocate zeroed memory aligned to a cache line. The address malloc
+// returned is stored just before the aligned one, for free_cache_aligned
+static void *calloc_cache_aligned(size_t size) {
+  char *memory = (char *)calloc(1, size + TEXTURE_CACHE_LINE + sizeof(void *));
+  if (memory == NULL) return NULL;
+
+  uintptr_t start = (uintptr_t)(memory + sizeof(void *));
+  char *aligned = memory + sizeof(void *) +
+                  ((TEXTURE_CACHE_LINE - start % TEXTURE_CACHE_LINE) %
+                   TEXTURE_CACHE_LINE);
+  ((void **)aligned)[-1] = memory;
+  return aligned;
+}
+
+static void free_cache_aligned(void *aligned) {
+  if (aligned) free(((void **)aligned)[-1]);
+}
+
+// Free the texels or blocks of a mip level, tiled texels are cache aligned
+void free_mipmap(mipmap_t *mipmap) {
+  if (mipmap->layout == TEXTURE_LAYOUT_TILED) {
+    free_cache_aligned(mipmap->texels);
+  } else {
+    free(mipmap->texels);
+  }
+  free(mipmap->blocks);
+  mipmap->texels = NULL;
+  mipmap->blocks = NULL;
+}
+
+// Return a copy of a linear mip level rearranged in 4x4 tiles, so texels that
+// are close in both u and v share a cache line: every tile is 64 bytes and
+// the level starts on a cache line. The size is padded to whole tiles. On
+// allocation failure the returned level has no texels
+mipmap_t make_tiled_mipmap(const mipmap_t *linear) {
+  mipmap_t tiled = make_mipmap(NULL, linear->width, linear->height,
+                               TEXTURE_LAYOUT_TILED);
+  int tiles_per_column =
+      (linear->height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+
+  tiled.texels = (uint32_t *)calloc_cache_aligned(
+      sizeof(uint32_t) * tiled.tiles_per_row * tiles_per_column *
+      TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE);
+  if (!tiled.texels) return tiled;
+
+  for (int y = 0; y < linear->height; y++) {
+    for (int x = 0; x < linear->width; x++) {
+      tiled.texels[mipmap_offset(&tiled, x, y)] =
+          linear->texels[mipmap_offset(linear, x, y)];
+    }
+  }
+
+  return tiled;
+}
+
+// Convert every level of the mip chain to the tiled layout
+bool tile_mipmaps(texture_t *texture) {
+  for (int i = 0; i < texture->num_mipmaps; i++) {
+    mipmap_t tiled = make_tiled_mipmap(&texture->mipmaps[i]);
+    if (!tiled.texels) return false;
+
+    free_mipmap(&texture->mipmaps[i]);
+    texture->mipmaps[i] = tiled;
+  }
+  return true;
+}
+
+static int mipmap_block_bytes(const mipmap_t *mipmap) {
+  return mipmap->layout == TEXTURE_LAYOUT_BC1 ? BC1_BLOCK_BYTES
+                                              : BC3_BLOCK_BYTES;
+}
 
-    if (upng_get_error(png_texture) == UPNG_EOK) {
-      mesh_texture = (uint32_t *)upng_get_buffer(png_texture);
-      texture_width = upng_get_width(png_texture);
-      texture_height = upng_get_height(png_texture);
+// Return a copy of a linear mip level compressed to BC1 or BC3 blocks. Tiles
+// crossing the edge repeat the last row and column of texels. On allocation
+// failure the returned level has no blocks
+mipmap_t make_compressed_mipmap(const mipmap_t *linear,
+                                enum texture_layout layout) {
+  mipmap_t compressed =
+      make_mipmap(NULL, linear->width, linear->height, layout);
+  int tiles_per_column =
+      (linear->height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+  int block_bytes = mipmap_block_bytes(&compressed);
 
-      for (int i = 0; i < texture_width * texture_height; i++) {
-        uint32_t color = mesh_texture[i];
-        uint32_t a = (color & 0xFF000000);
-        uint32_t r = (color & 0x00FF0000) >> 16;
-        uint32_t g = (color & 0x0000FF00);
-        uint32_t b = (color & 0x000000FF) << 16;
+  compressed.blocks = (uint8_t *)malloc(
+      (size_t)compressed.tiles_per_row * tiles_per_column * block_bytes);
+  if (!compressed.blocks) return compressed;
 
-        mesh_texture[i] = (a | r | g | b);
+  uint8_t *block = compressed.blocks;
+  for (int tile_y = 0; tile_y < tiles_per_column; tile_y++) {
+    for (int tile_x = 0; tile_x < compressed.tiles_per_row; tile_x++) {
+      uint32_t texels[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE];
+      for (int i = 0; i < TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE; i++) {
+        int x = tile_x * TEXTURE_TILE_SIZE + i % TEXTURE_TILE_SIZE;
+        int y = tile_y * TEXTURE_TILE_SIZE + i / TEXTURE_TILE_SIZE;
+        if (x >= linear->width) x = linear->width - 1;
+        if (y >= linear->height) y = linear->height - 1;
+        texels[i] = linear->texels[mipmap_offset(linear, x, y)];
       }
+
+      if (layout == TEXTURE_LAYOUT_BC1) {
+        encode_bc1_block(texels, block);
+      } else {
+        encode_bc3_block(texels, block);
+      }
+      block += block_bytes;
     }
   }
+
+  return compressed;
+}
+
+// Compress every level of the mip chain, with BC1 when level 0 is opaque so
+// the alpha blocks are only spent on textures that need them
+bool compress_mipmaps(texture_t *texture) {
+  const mipmap_t *base = &texture->mipmaps[0];
+  enum texture_layout layout = TEXTURE_LAYOUT_BC1;
+  for (int i = 0; i < base->width * base->height; i++) {
+    if ((base->texels[i] >> 24) != 0xFF) {
+      layout = TEXTURE_LAYOUT_BC3;
+      break;
+    }
+  }
+
+  for (int i = 0; i < texture->num_mipmaps; i++) {
+    mipmap_t compressed =
+        make_compressed_mipmap(&texture->mipmaps[i], layout);
+    if (!compressed.blocks) return false;
+
+    free_mipmap(&texture->mipmaps[i]);
+    texture->mipmaps[i] = compressed;
+  }
+  return true;
+}
+
+// Decode a PNG opened by upng into the texture and build its mip chain,
+// taking ownership of the upng object. For a PNG read from a file, the hash
+// of the file is stored in *file_hash if it is not NULL
+bool load_png_texture(texture_t *texture, upng_t *png_texture,
+                      const char *name, uint64_t *file_hash) {
+  texture->num_mipmaps = 0;
+  texture->wrap = TEXTURE_WRAP_REPEAT;
+
+  if (png_texture == NULL) return false;
+
+  // Let upng convert the texels to ARGB as it unfilters each scanline, so
+  // the decoded image is only written once and becomes level 0 as is
+  upng_set_output(png_texture, UPNG_OUTPUT_ARGB8888);
+  upng_decode(png_texture);
+  if (upng_get_error(png_texture) != UPNG_EOK) {
+    fprintf(stderr, "Error decoding PNG file %s.\n", name);
+    upng_free(png_texture);
+    return false;
+  }
+
+  int width = upng_get_width(png_texture);
+  int height = upng_get_height(png_texture);
+  uint32_t *texels = (uint32_t *)upng_release_buffer(png_texture);
+  if (file_hash) *file_hash = upng_get_file_hash(png_texture);
+  upng_free(png_texture);
+
+  texture->mipmaps[0] =
+      make_mipmap(texels, width, height, TEXTURE_LAYOUT_LINEAR);
+  texture->num_mipmaps = 1;
+
+  // Compressed levels keep the order of the tiles, as 4x4 blocks
+  if (!build_mipmaps(texture) ||
+      !(compress_textures ? compress_mipmaps(texture)
+                          : tile_mipmaps(texture))) {
+    free_texture_data(texture);
+    return false;
+  }
+
+  return true;
+}
+
+bool load_png_texture_data(texture_t *texture, char *filename) {
+  return load_png_texture(texture, upng_new_from_file(filename), filename,
+                          NULL);
+}
+
+// Decode a PNG file a piece at a time, hashing its bytes with FNV-1a as they
+// are read
+bool load_png_texture_file(texture_t *texture, const char *filename,
+                           uint64_t *file_hash) {
+  return load_png_texture(texture, upng_new_from_file(filename), filename,
+                          file_hash);
+}
+
+void free_texture_data(texture_t *texture) {
+  for (int i = 0; i < texture->num_mipmaps; i++) {
+    free_mipmap(&texture->mipmaps[i]);
+  }
+  texture->num_mipmaps = 0;
+}
+
+size_t texture_memory_size(const texture_t *texture) {
+  size_t size = 0;
+  for (int i = 0; i < texture->num_mipmaps; i++) {
+    const mipmap_t *mipmap = &texture->mipmaps[i];
+    if (mipmap->blocks) {
+      int tiles_per_column =
+          (mipmap->height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+      size += (size_t)mipmap->tiles_per_row * tiles_per_column *
+              mipmap_block_bytes(mipmap);
+    } else {
+      size += sizeof(uint32_t) * mipmap->width * mipmap->height;
+    }
+  }
+  return size;
+}
+
+void texture_block_cache_clear(texture_block_cache_t *cache) {
+  cache->texture = NULL;
+  memset(cache->blocks, 0, sizeof(cache->blocks));
+}
+
+// Return the texel of a mip level at a position inside of it. The blocks of
+// compressed levels are decoded on demand, through the cache when given one
+uint32_t mipmap_texel(const mipmap_t *mipmap, texture_block_cache_t *cache,
+                      int x, int y) {
+  if (mipmap->texels) return mipmap->texels[mipmap_offset(mipmap, x, y)];
+
+  int tile = mipmap->tiles_per_row * (y >> TEXTURE_TILE_SHIFT) +
+             (x >> TEXTURE_TILE_SHIFT);
+  int texel = ((y & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_SHIFT) +
+              (x & (TEXTURE_TILE_SIZE - 1));
+  int block_bytes = mipmap_block_bytes(mipmap);
+  const uint8_t *block = mipmap->blocks + (size_t)tile * block_bytes;
+
+  uint32_t decoded[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE];
+  uint32_t *texels = decoded;
+  if (cache) {
+    // Neighbouring blocks of a level map to neighbouring slots
+    int slot =
+        ((uintptr_t)block / block_bytes) & (TEXTURE_BLOCK_CACHE_SIZE - 1);
+    texels = cache->texels[slot];
+    if (cache->blocks[slot] == block) return texels[texel];
+    cache->blocks[slot] = block;
+  }
+
+  if (mipmap->layout == TEXTURE_LAYOUT_BC1) {
+    decode_bc1_block(block, texels);
+  } else {
+    decode_bc3_block(block, texels);
+  }
+  return texels[texel];
+}
+
+// Map a texture coordinate to a texel index of a mip level side following
+// the wrap mode of the texture. Power-of-two sides wrap with a mask, which
+// also handles negative coordinates thanks to two's complement
+int wrap_texel_coord(enum texture_wrap wrap, int coord, int size, int mask,
+                     bool is_power_of_two) {
+  if (wrap == TEXTURE_WRAP_CLAMP) {
+    return coord < 0 ? 0 : (coord >= size ? size - 1 : coord);
+  }
+  if (is_power_of_two) {
+    return coord & mask;
+  }
+  coord %= size;
+  return coord < 0 ? coord + size : coord;
+}
+
+uint32_t texture_sample_nearest(const texture_t *texture,
+                                const mipmap_t *mipmap,
+                                texture_block_cache_t *cache, float u,
+                                float v) {
+  // Round towards negative infinity, so coordinates just below 0 wrap around
+  float texel_u = u * mipmap->u_scale;
+  float texel_v = v * mipmap->v_scale;
+  int x = (int)texel_u;
+  int y = (int)texel_v;
+  if (texel_u < x) x--;
+  if (texel_v < y) y--;
+
+  x = wrap_texel_coord(texture->wrap, x, mipmap->width, mipmap->width_mask,
+                       mipmap->is_power_of_two);
+  y = wrap_texel_coord(texture->wrap, y, mipmap->height, mipmap->height_mask,
+                       mipmap->is_power_of_two);
+
+  return mipmap_texel(mipmap, cache, x, y);
+}
+
+// Blend two ARGB texels channel by channel, with weight from 0 (only a) to
+// 256 (only b)
+uint32_t lerp_texels(uint32_t a, uint32_t b, int weight) {
+  uint32_t result = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t ca = (a >> shift) & 0xFF;
+    uint32_t cb = (b >> shift) & 0xFF;
+    result |= (((ca * (256 - weight) + cb * weight) >> 8) & 0xFF) << shift;
+  }
+  return result;
+}
+
+// Blend the 2x2 block of ARGB texels c00 c10 (top) and c01 c11 (bottom) with
+// 8-bit fractional weights fx and fy from 0 to 256
+uint32_t bilerp_texels(uint32_t c00, uint32_t c10, uint32_t c01, uint32_t c11,
+                       int fx, int fy) {
+#if defined(__SSE2__)
+  // Widen the channels of the left and right texels of each row to 16 bits.
+  // Every product stays below 255 * 256, so unsigned 16-bit lanes never
+  // overflow and mullo gives the exact result
+  __m128i zero = _mm_setzero_si128();
+  __m128i top = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, c10, c00), zero);
+  __m128i bottom = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, c11, c01), zero);
+
+  // Vertical lerp of both columns at once
+  __m128i column = _mm_add_epi16(
+      _mm_mullo_epi16(top, _mm_set1_epi16((short)(256 - fy))),
+      _mm_mullo_epi16(bottom, _mm_set1_epi16((short)fy)));
+  column = _mm_srli_epi16(column, 8);
+
+  // Horizontal lerp, weighting the left half and the right half and adding
+  // the right half onto the left one
+  __m128i weights = _mm_set_epi16(fx, fx, fx, fx, 256 - fx, 256 - fx, 256 - fx,
+                                  256 - fx);
+  __m128i products = _mm_mullo_epi16(column, weights);
+  __m128i color = _mm_srli_epi16(
+      _mm_add_epi16(products, _mm_srli_si128(products, 8)), 8);
+
+  return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(color, zero));
+#else
+  return lerp_texels(lerp_texels(c00, c01, fy), lerp_texels(c10, c11, fy), fx);
+#endif
+}
+
+uint32_t texture_sample_bilinear(const texture_t *texture,
+                                 const mipmap_t *mipmap,
+                                 texture_block_cache_t *cache, float u,
+                                 float v) {
+  // Texel centers are at half coordinates, so shift by half a texel to find
+  // the top-left texel of the 2x2 block around the sample
+  float texel_u = u * mipmap->u_scale - 0.5;
+  float texel_v = v * mipmap->v_scale - 0.5;
+  int x = (int)texel_u;
+  int y = (int)texel_v;
+  if (texel_u < x) x--;
+  if (texel_v < y) y--;
+
+  int fx = (int)((texel_u - x) * 256);
+  int fy = (int)((texel_v - y) * 256);
+
+  int x0 = wrap_texel_coord(texture->wrap, x, mipmap->width,
+                            mipmap->width_mask, mipmap->is_power_of_two);
+  int x1 = wrap_texel_coord(texture->wrap, x + 1, mipmap->width,
+                            mipmap->width_mask, mipmap->is_power_of_two);
+  int y0 = wrap_texel_coord(texture->wrap, y, mipmap->height,
+                            mipmap->height_mask, mipmap->is_power_of_two);
+  int y1 = wrap_texel_coord(texture->wrap, y + 1, mipmap->height,
+                            mipmap->height_mask, mipmap->is_power_of_two);
+
+  return bilerp_texels(mipmap_texel(mipmap, cache, x0, y0),
+                       mipmap_texel(mipmap, cache, x1, y0),
+                       mipmap_texel(mipmap, cache, x0, y1),
+                       mipmap_texel(mipmap, cache, x1, y1), fx, fy);
+}
+
+// Prepare the sampling of a texture for a level of detail (0 is the full
+// resolution level, every unit further halves it)
+sampler_t make_sampler(const texture_t *texture, float lod,
+                       enum texture_filter filter) {
+  int last = texture->num_mipmaps - 1;
+  int level = (int)lod;
+  int next_level = level + 1;
+  if (level > last) level = last;
+  if (next_level > last) next_level = last;
+
+  sampler_t sampler = {.texture = texture,
+                       .mipmap = &texture->mipmaps[level],
+                       .next_mipmap = &texture->mipmaps[next_level],
+                       .lod_weight = (int)((lod - (int)lod) * 256),
+                       .filter = filter,
+                       .block_cache = NULL};
+  return sampler;
+}
+
+uint32_t sampler_fetch(const sampler_t *sampler, float u, float v) {
+  switch (sampler->filter) {
+    case FILTER_BILINEAR:
+      return texture_sample_bilinear(sampler->texture, sampler->mipmap,
+                                     sampler->block_cache, u, v);
+    case FILTER_TRILINEAR:
+      return lerp_texels(
+          texture_sample_bilinear(sampler->texture, sampler->mipmap,
+                                  sampler->block_cache, u, v),
+          texture_sample_bilinear(sampler->texture, sampler->next_mipmap,
+                                  sampler->block_cache, u, v),
+          sampler->lod_weight);
+    default:
+      return texture_sample_nearest(sampler->texture, sampler->mipmap,
+                                    sampler->block_cache, u, v);
+  }
+}
+
+// Texels read by every sampler_fetch, for the pipeline counters
+int sampler_texels_per_fetch(const sampler_t *sampler) {
+  switch (sampler->filter) {
+    case FILTER_BILINEAR:
+      return 4;
+    case FILTER_TRILINEAR:
+      return 8;
+    default:
+      return 1;
+  }
 }
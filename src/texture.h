@@ -1,20 +1,120 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "upng.h"
 
+// Enough levels for a 32768x32768 texture down to 1x1
+#define MAX_MIPMAP_LEVELS 16
+
+// Texels of a tiled texture are stored in blocks of 4x4 (64 bytes, a cache
+// line), one block after the other in row-major order of the blocks
+#define TEXTURE_TILE_SHIFT 2
+#define TEXTURE_TILE_SIZE (1 << TEXTURE_TILE_SHIFT)
+
+// Alignment in bytes of the tiled levels, so no tile straddles two lines
+#define TEXTURE_CACHE_LINE 64
+
 typedef struct {
   float u;
   float v;
 } tex2_t;
 
-extern int texture_width;
-extern int texture_height;
+// The compressed layouts store every 4x4 tile as one BC1 (opaque) or BC3
+// block, in the same order as the tiles of the tiled layout
+enum texture_layout {
+  TEXTURE_LAYOUT_LINEAR,
+  TEXTURE_LAYOUT_TILED,
+  TEXTURE_LAYOUT_BC1,
+  TEXTURE_LAYOUT_BC3
+};
+
+// How texture coordinates outside of [0, 1] are addressed
+enum texture_wrap { TEXTURE_WRAP_REPEAT, TEXTURE_WRAP_CLAMP };
+
+// One level of a mip chain, each level is half the size of the previous one.
+// The addressing constants are computed once by make_mipmap
+typedef struct {
+  uint32_t *texels;  // NULL for the compressed layouts
+  uint8_t *blocks;   // Compressed blocks, NULL for the other layouts
+  int width;
+  int height;
+  int tiles_per_row;
+  enum texture_layout layout;
+  bool is_power_of_two;  // Both sides are powers of two, so wrap with masks
+  int width_mask;        // width - 1
+  int height_mask;       // height - 1
+  float u_scale;         // width as a float, to map u into texels
+  float v_scale;         // height as a float, to map v into texels
+} mipmap_t;
+
+typedef struct {
+  mipmap_t mipmaps[MAX_MIPMAP_LEVELS];
+  int num_mipmaps;
+  enum texture_wrap wrap;
+} texture_t;
+
+enum texture_filter { FILTER_NEAREST, FILTER_BILINEAR, FILTER_TRILINEAR };
+
+// Number of decoded blocks kept by a block cache, a power of two
+#define TEXTURE_BLOCK_CACHE_SIZE 64
+
+// Recently decoded blocks of compressed levels, direct mapped by the address
+// of the block. Every rasterizing thread uses its own, so it needs no lock,
+// and clears it when it starts sampling another texture
+typedef struct {
+  const texture_t *texture;  // Texture the blocks belong to, NULL when empty
+  const uint8_t *blocks[TEXTURE_BLOCK_CACHE_SIZE];  // NULL when empty
+  uint32_t texels[TEXTURE_BLOCK_CACHE_SIZE][16];
+} texture_block_cache_t;
+
+// Mip levels and filter used to sample a texture across one triangle
+typedef struct {
+  const texture_t *texture;
+  const mipmap_t *mipmap;       // Level sampled by every filter
+  const mipmap_t *next_mipmap;  // Smaller level blended in by trilinear
+  int lod_weight;               // Weight of next_mipmap, from 0 to 256
+  enum texture_filter filter;
+  texture_block_cache_t *block_cache;  // For compressed levels, may be NULL
+} sampler_t;
+
+extern enum texture_filter texture_filter;
+
+// Whether loaded textures are compressed to BC1/BC3 blocks, which is lossy
+extern bool compress_textures;
+
+bool load_png_texture_data(texture_t *texture, char *filename);
+bool load_png_texture_file(texture_t *texture, const char *filename,
+                           uint64_t *file_hash);
+void free_texture_data(texture_t *texture);
+size_t texture_memory_size(const texture_t *texture);
+
+mipmap_t make_mipmap(uint32_t *texels, int width, int height,
+                     enum texture_layout layout);
+int mipmap_offset(const mipmap_t *mipmap, int x, int y);
+mipmap_t make_tiled_mipmap(const mipmap_t *linear);
+void free_mipmap(mipmap_t *mipmap);
+mipmap_t make_compressed_mipmap(const mipmap_t *linear,
+                                enum texture_layout layout);
+
+void texture_block_cache_clear(texture_block_cache_t *cache);
+uint32_t mipmap_texel(const mipmap_t *mipmap, texture_block_cache_t *cache,
+                      int x, int y);
 
-extern upng_t* png_texture;
-extern uint32_t *mesh_texture;
+uint32_t texture_sample_nearest(const texture_t *texture,
+                                const mipmap_t *mipmap,
+                                texture_block_cache_t *cache, float u, float v);
+uint32_t texture_sample_bilinear(const texture_t *texture,
+                                 const mipmap_t *mipmap,
+                                 texture_block_cache_t *cache, float u,
+                                 float v);
+uint32_t lerp_texels(uint32_t a, uint32_t b, int weight);
 
-void load_png_texture_data(char *filename);
+sampler_t make_sampler(const texture_t *texture, float lod,
+                       enum texture_filter filter);
+uint32_t sampler_fetch(const sampler_t *sampler, float u, float v);
+int sampler_texels_per_fetch(const sampler_t *sampler);
 
-#endif
\ No newline at end of file
+#endif
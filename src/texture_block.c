@@ -0,0 +1,238 @@
+#include "texture_block.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+static uint16_t pack_rgb565(int r, int g, int b) {
+  return (uint16_t)((((r * 31 + 127) / 255) << 11) |
+                    (((g * 63 + 127) / 255) << 5) | ((b * 31 + 127) / 255));
+}
+
+// Expand an RGB565 color to an opaque ARGB texel, replicating the high bits
+// into the low ones so 0 and the maximum map to 0x00 and 0xFF
+static uint32_t unpack_rgb565(uint16_t color) {
+  uint32_t r = (color >> 11) & 31;
+  uint32_t g = (color >> 5) & 63;
+  uint32_t b = color & 31;
+  return 0xFF000000 | ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) |
+         (b << 3 | b >> 2);
+}
+
+// Weighted average of the RGB channels of two texels, opaque
+static uint32_t mix_colors(uint32_t a, uint32_t b, int weight_a,
+                           int weight_b) {
+  uint32_t result = 0xFF000000;
+  for (int shift = 0; shift < 24; shift += 8) {
+    uint32_t channel = (((a >> shift) & 0xFF) * weight_a +
+                        ((b >> shift) & 0xFF) * weight_b) /
+                       (weight_a + weight_b);
+    result |= channel << shift;
+  }
+  return result;
+}
+
+// The colors a block can index. BC1 switches to 3 colors and transparent
+// black when the first endpoint is not the larger one, BC3 always uses 4
+static void color_palette(uint16_t c0, uint16_t c1, bool four_colors,
+                          uint32_t palette[4]) {
+  palette[0] = unpack_rgb565(c0);
+  palette[1] = unpack_rgb565(c1);
+  if (four_colors) {
+    palette[2] = mix_colors(palette[0], palette[1], 2, 1);
+    palette[3] = mix_colors(palette[0], palette[1], 1, 2);
+  } else {
+    palette[2] = mix_colors(palette[0], palette[1], 1, 1);
+    palette[3] = 0;
+  }
+}
+
+static void alpha_palette(int a0, int a1, int palette[8]) {
+  palette[0] = a0;
+  palette[1] = a1;
+  if (a0 > a1) {
+    for (int i = 2; i < 8; i++) {
+      palette[i] = ((8 - i) * a0 + (i - 1) * a1) / 7;
+    }
+  } else {
+    for (int i = 2; i < 6; i++) {
+      palette[i] = ((6 - i) * a0 + (i - 1) * a1) / 5;
+    }
+    palette[6] = 0;
+    palette[7] = 255;
+  }
+}
+
+static int color_distance(uint32_t a, uint32_t b) {
+  int distance = 0;
+  for (int shift = 0; shift < 24; shift += 8) {
+    int d = (int)((a >> shift) & 0xFF) - (int)((b >> shift) & 0xFF);
+    distance += d * d;
+  }
+  return distance;
+}
+
+// Pick the endpoints among the texels at both ends of the principal axis of
+// their colors, found with a few power iterations on the covariance matrix,
+// then index every texel with the nearest palette color
+static void encode_color(const uint32_t texels[16], uint8_t *block) {
+  float mean[3] = {0, 0, 0};
+  for (int i = 0; i < 16; i++) {
+    for (int c = 0; c < 3; c++) mean[c] += (texels[i] >> (16 - 8 * c)) & 0xFF;
+  }
+  for (int c = 0; c < 3; c++) mean[c] /= 16;
+
+  float covariance[3][3] = {{0}};
+  for (int i = 0; i < 16; i++) {
+    float d[3];
+    for (int c = 0; c < 3; c++) {
+      d[c] = ((texels[i] >> (16 - 8 * c)) & 0xFF) - mean[c];
+    }
+    for (int row = 0; row < 3; row++) {
+      for (int col = 0; col < 3; col++) covariance[row][col] += d[row] * d[col];
+    }
+  }
+
+  float axis[3] = {1, 1, 1};
+  for (int iteration = 0; iteration < 4; iteration++) {
+    float next[3];
+    float largest = 0;
+    for (int row = 0; row < 3; row++) {
+      next[row] = covariance[row][0] * axis[0] + covariance[row][1] * axis[1] +
+                  covariance[row][2] * axis[2];
+      float magnitude = next[row] < 0 ? -next[row] : next[row];
+      if (magnitude > largest) largest = magnitude;
+    }
+    if (largest == 0) break;
+    for (int c = 0; c < 3; c++) axis[c] = next[c] / largest;
+  }
+
+  int min_texel = 0;
+  int max_texel = 0;
+  float min_projection = 0;
+  float max_projection = 0;
+  for (int i = 0; i < 16; i++) {
+    float projection = 0;
+    for (int c = 0; c < 3; c++) {
+      projection += ((texels[i] >> (16 - 8 * c)) & 0xFF) * axis[c];
+    }
+    if (i == 0 || projection < min_projection) {
+      min_projection = projection;
+      min_texel = i;
+    }
+    if (i == 0 || projection > max_projection) {
+      max_projection = projection;
+      max_texel = i;
+    }
+  }
+
+  uint16_t c0 = pack_rgb565((texels[max_texel] >> 16) & 0xFF,
+                            (texels[max_texel] >> 8) & 0xFF,
+                            texels[max_texel] & 0xFF);
+  uint16_t c1 = pack_rgb565((texels[min_texel] >> 16) & 0xFF,
+                            (texels[min_texel] >> 8) & 0xFF,
+                            texels[min_texel] & 0xFF);
+  // The 4 color mode needs the larger endpoint first
+  if (c0 < c1) {
+    uint16_t swap = c0;
+    c0 = c1;
+    c1 = swap;
+  }
+
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    uint32_t palette[4];
+    color_palette(c0, c1, true, palette);
+    for (int i = 0; i < 16; i++) {
+      int best = 0;
+      int best_distance = color_distance(texels[i], palette[0]);
+      for (int p = 1; p < 4; p++) {
+        int distance = color_distance(texels[i], palette[p]);
+        if (distance < best_distance) {
+          best = p;
+          best_distance = distance;
+        }
+      }
+      indices |= (uint32_t)best << (2 * i);
+    }
+  }
+
+  block[0] = c0 & 0xFF;
+  block[1] = c0 >> 8;
+  block[2] = c1 & 0xFF;
+  block[3] = c1 >> 8;
+  for (int i = 0; i < 4; i++) block[4 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+// The alpha endpoints are the extremes of the block, with the 8 alpha mode
+static void encode_alpha(const uint32_t texels[16], uint8_t *block) {
+  int a0 = 0;
+  int a1 = 255;
+  for (int i = 0; i < 16; i++) {
+    int alpha = texels[i] >> 24;
+    if (alpha > a0) a0 = alpha;
+    if (alpha < a1) a1 = alpha;
+  }
+
+  uint64_t indices = 0;
+  if (a0 > a1) {
+    int palette[8];
+    alpha_palette(a0, a1, palette);
+    for (int i = 0; i < 16; i++) {
+      int alpha = texels[i] >> 24;
+      int best = 0;
+      int best_distance = 256;
+      for (int p = 0; p < 8; p++) {
+        int distance = abs(alpha - palette[p]);
+        if (distance < best_distance) {
+          best = p;
+          best_distance = distance;
+        }
+      }
+      indices |= (uint64_t)best << (3 * i);
+    }
+  }
+
+  block[0] = a0;
+  block[1] = a1;
+  for (int i = 0; i < 6; i++) block[2 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+void encode_bc1_block(const uint32_t texels[16], uint8_t *block) {
+  encode_color(texels, block);
+}
+
+void encode_bc3_block(const uint32_t texels[16], uint8_t *block) {
+  encode_alpha(texels, block);
+  encode_color(texels, block + 8);
+}
+
+static void decode_color(const uint8_t *block, bool is_bc1,
+                         uint32_t texels[16]) {
+  uint16_t c0 = block[0] | block[1] << 8;
+  uint16_t c1 = block[2] | block[3] << 8;
+  uint32_t indices = (uint32_t)block[4] | (uint32_t)block[5] << 8 |
+                     (uint32_t)block[6] << 16 | (uint32_t)block[7] << 24;
+
+  uint32_t palette[4];
+  color_palette(c0, c1, !is_bc1 || c0 > c1, palette);
+  for (int i = 0; i < 16; i++) {
+    texels[i] = palette[(indices >> (2 * i)) & 3];
+  }
+}
+
+void decode_bc1_block(const uint8_t *block, uint32_t texels[16]) {
+  decode_color(block, true, texels);
+}
+
+void decode_bc3_block(const uint8_t *block, uint32_t texels[16]) {
+  decode_color(block + 8, false, texels);
+
+  int palette[8];
+  alpha_palette(block[0], block[1], palette);
+  uint64_t indices = 0;
+  for (int i = 0; i < 6; i++) indices |= (uint64_t)block[2 + i] << (8 * i);
+  for (int i = 0; i < 16; i++) {
+    uint32_t alpha = palette[(indices >> (3 * i)) & 7];
+    texels[i] = (texels[i] & 0x00FFFFFF) | alpha << 24;
+  }
+}
@@ -0,0 +1,18 @@
+#ifndef TEXTURE_BLOCK_H
+#define TEXTURE_BLOCK_H
+
+#include <stdint.h>
+
+// BC1 stores a 4x4 block of opaque texels in 8 bytes: two RGB565 endpoints
+// and a 2-bit index per texel into a palette of 4 colors between them. BC3
+// puts 8 bytes of alpha in front: two 8-bit endpoints and a 3-bit index per
+// texel into a palette of 8 alphas
+#define BC1_BLOCK_BYTES 8
+#define BC3_BLOCK_BYTES 16
+
+void encode_bc1_block(const uint32_t texels[16], uint8_t *block);
+void encode_bc3_block(const uint32_t texels[16], uint8_t *block);
+void decode_bc1_block(const uint8_t *block, uint32_t texels[16]);
+void decode_bc3_block(const uint8_t *block, uint32_t texels[16]);
+
+#endif
@@ -0,0 +1,234 @@
+#include "texture_cache.h"
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "file.h"
+#include "trace.h"
+
+// A decoded texture shared by every mesh that acquired it. Entries form a
+// doubly linked list from the most recently used to the least recently used
+typedef struct texture_cache_entry {
+  texture_t texture;
+  char **paths;           // Dynamic array of the files with this content
+  uint64_t content_hash;  // FNV-1a hash of the PNG file
+  size_t memory_size;     // Bytes used by the texels
+  int references;         // Acquired and not released yet, never evicted
+  struct texture_cache_entry *prev;
+  struct texture_cache_entry *next;
+} texture_cache_entry_t;
+
+static texture_cache_entry_t *most_recent = NULL;
+static texture_cache_entry_t *least_recent = NULL;
+static size_t memory_budget = TEXTURE_CACHE_DEFAULT_BUDGET;
+static size_t memory_used = 0;
+
+// Protects the entries and the memory counters, so textures can be acquired
+// from worker threads. Files are read and decoded without holding it
+static SDL_mutex *cache_mutex = NULL;
+
+void texture_cache_init(size_t budget) {
+  texture_cache_free();
+  memory_budget = budget;
+  cache_mutex = SDL_CreateMutex();
+}
+
+static void unlink_entry(texture_cache_entry_t *entry) {
+  if (entry->prev) entry->prev->next = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  if (most_recent == entry) most_recent = entry->next;
+  if (least_recent == entry) least_recent = entry->prev;
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+static void push_most_recent(texture_cache_entry_t *entry) {
+  entry->next = most_recent;
+  if (most_recent) most_recent->prev = entry;
+  most_recent = entry;
+  if (least_recent == NULL) least_recent = entry;
+}
+
+static void free_entry(texture_cache_entry_t *entry) {
+  for (size_t i = 0; i < array_length(entry->paths); i++) {
+    free(entry->paths[i]);
+  }
+  array_free(entry->paths);
+  free_texture_data(&entry->texture);
+  free(entry);
+}
+
+// Evict the least recently used textures nobody holds until the cache fits
+// in its budget. Textures in use are kept even when that exceeds the budget
+static void evict_over_budget(void) {
+  texture_cache_entry_t *entry = least_recent;
+  while (entry && memory_used > memory_budget) {
+    texture_cache_entry_t *prev = entry->prev;
+    if (entry->references == 0) {
+      unlink_entry(entry);
+      memory_used -= entry->memory_size;
+      free_entry(entry);
+    }
+    entry = prev;
+  }
+}
+
+static texture_cache_entry_t *find_by_path(const char *filename) {
+  for (texture_cache_entry_t *entry = most_recent; entry; entry = entry->next) {
+    for (size_t i = 0; i < array_length(entry->paths); i++) {
+      if (strcmp(entry->paths[i], filename) == 0) return entry;
+    }
+  }
+  return NULL;
+}
+
+// Find the entry decoded from a file with the same bytes as filename. The
+// hash only narrows the search, on a match the file of the entry is read
+// again and compared with filename before the entry is reused
+static texture_cache_entry_t *find_by_content(uint64_t content_hash,
+                                              const char *filename) {
+  for (texture_cache_entry_t *entry = most_recent; entry; entry = entry->next) {
+    if (entry->content_hash == content_hash &&
+        files_equal(entry->paths[0], filename)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static char *copy_string(const char *string) {
+  char *copy = (char *)malloc(strlen(string) + 1);
+  if (copy) strcpy(copy, string);
+  return copy;
+}
+
+// Remember the path so later lookups of it skip reading and hashing the file
+static void add_path(texture_cache_entry_t *entry, const char *filename) {
+  for (size_t i = 0; i < array_length(entry->paths); i++) {
+    if (strcmp(entry->paths[i], filename) == 0) return;
+  }
+  char *path = copy_string(filename);
+  if (path && !array_push(entry->paths, path)) free(path);
+}
+
+// Hand out one more reference to a cached entry
+static void use_entry(texture_cache_entry_t *entry) {
+  unlink_entry(entry);
+  push_most_recent(entry);
+  entry->references++;
+
+  evict_over_budget();
+}
+
+// Return the texture decoded from a PNG file, loading it only if neither the
+// same path nor a file with the same content is cached yet. The file is
+// hashed while it is decoded, so a file with the same content under another
+// path is decoded once more and that copy dropped. Every acquired texture
+// must be given back with texture_cache_release
+texture_t *texture_cache_acquire(const char *filename) {
+  SDL_LockMutex(cache_mutex);
+  texture_cache_entry_t *entry = find_by_path(filename);
+  if (entry) use_entry(entry);
+  SDL_UnlockMutex(cache_mutex);
+  if (entry) return &entry->texture;
+
+  trace_zone_t decode_zone = trace_begin("decode_texture");
+  uint64_t content_hash = 0;
+  texture_cache_entry_t *loaded =
+      (texture_cache_entry_t *)calloc(1, sizeof(texture_cache_entry_t));
+  bool decoded = loaded && load_png_texture_file(&loaded->texture, filename,
+                                                 &content_hash);
+  trace_end(decode_zone);
+  if (!decoded) {
+    free(loaded);
+    return NULL;
+  }
+
+  SDL_LockMutex(cache_mutex);
+  // The same content may be cached under another path, or loaded by another
+  // thread while this one decoded it, then the copy decoded here is dropped
+  entry = find_by_content(content_hash, filename);
+  if (entry == NULL) {
+    entry = loaded;
+    loaded = NULL;
+    entry->content_hash = content_hash;
+    entry->memory_size = texture_memory_size(&entry->texture);
+    memory_used += entry->memory_size;
+  }
+  add_path(entry, filename);
+  use_entry(entry);
+  SDL_UnlockMutex(cache_mutex);
+
+  if (loaded) free_entry(loaded);
+  return &entry->texture;
+}
+
+void texture_cache_release(texture_t *texture) {
+  if (texture == NULL) return;
+
+  // The texture is the first member of its entry
+  texture_cache_entry_t *entry = (texture_cache_entry_t *)texture;
+  SDL_LockMutex(cache_mutex);
+  if (entry->references > 0) entry->references--;
+
+  // Unused textures stay cached until the budget needs their memory
+  evict_over_budget();
+  SDL_UnlockMutex(cache_mutex);
+}
+
+// Acquire the texture on a worker thread. The filename must stay valid until
+// the job finished, which stores the texture (or NULL) in *texture
+typedef struct {
+  const char *filename;
+  texture_t **texture;
+} acquire_request_t;
+
+static int acquire_job(void *data) {
+  acquire_request_t *request = (acquire_request_t *)data;
+  *request->texture = texture_cache_acquire(request->filename);
+  int result = *request->texture != NULL;
+  free(request);
+  return result;
+}
+
+job_t *texture_cache_acquire_async(const char *filename, texture_t **texture) {
+  acquire_request_t *request =
+      (acquire_request_t *)malloc(sizeof(acquire_request_t));
+  if (request == NULL) return NULL;
+  request->filename = filename;
+  request->texture = texture;
+
+  job_t *job = job_submit(acquire_job, request);
+  if (job == NULL) free(request);
+  return job;
+}
+
+void texture_cache_set_budget(size_t budget) {
+  SDL_LockMutex(cache_mutex);
+  memory_budget = budget;
+  evict_over_budget();
+  SDL_UnlockMutex(cache_mutex);
+}
+
+size_t texture_cache_memory_used(void) {
+  SDL_LockMutex(cache_mutex);
+  size_t used = memory_used;
+  SDL_UnlockMutex(cache_mutex);
+  return used;
+}
+
+// Free every cached texture. No texture may be acquired concurrently
+void texture_cache_free(void) {
+  while (most_recent) {
+    texture_cache_entry_t *entry = most_recent;
+    unlink_entry(entry);
+    free_entry(entry);
+  }
+  memory_used = 0;
+
+  SDL_DestroyMutex(cache_mutex);
+  cache_mutex = NULL;
+}
@@ -0,0 +1,21 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <stddef.h>
+
+#include "job.h"
+#include "texture.h"
+
+// Memory that decoded textures (with their mip chains) may use before unused
+// ones are evicted
+#define TEXTURE_CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+void texture_cache_init(size_t budget);
+void texture_cache_set_budget(size_t budget);
+texture_t *texture_cache_acquire(const char *filename);
+job_t *texture_cache_acquire_async(const char *filename, texture_t **texture);
+void texture_cache_release(texture_t *texture);
+size_t texture_cache_memory_used(void);
+void texture_cache_free(void);
+
+#endif
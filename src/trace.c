@@ -0,0 +1,143 @@
+#include "trace.h"
+
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Most threads traced, further ones drop their events
+#define TRACE_MAX_THREADS 32
+
+typedef struct {
+  const char *name;
+  uint64_t begin;  // Performance counter ticks
+  uint64_t end;
+} trace_event_t;
+
+// Events of one thread. Only the owning thread writes to its ring, and it
+// publishes every event by storing the new count, so recording takes no lock
+typedef struct {
+  const char *thread_name;
+  SDL_atomic_t count;  // Events recorded so far, wrapping around the ring
+  trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+static SDL_TLSID ring_key = 0;
+static SDL_atomic_t num_rings;
+static trace_ring_t *rings[TRACE_MAX_THREADS];
+static uint64_t start_ticks = 0;
+
+bool trace_init(void) {
+  if (ring_key == 0) ring_key = SDL_TLSCreate();
+  start_ticks = SDL_GetPerformanceCounter();
+  return ring_key != 0;
+}
+
+// The ring of the calling thread, created on its first event. Its slot is
+// claimed with an atomic increment so threads can start tracing at any time
+static trace_ring_t *thread_ring(void) {
+  if (ring_key == 0) return NULL;
+
+  trace_ring_t *ring = (trace_ring_t *)SDL_TLSGet(ring_key);
+  if (ring) return ring;
+  if (SDL_AtomicGet(&num_rings) >= TRACE_MAX_THREADS) return NULL;
+
+  ring = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+  if (ring == NULL) return NULL;
+
+  int slot = SDL_AtomicAdd(&num_rings, 1);
+  if (slot >= TRACE_MAX_THREADS) {
+    free(ring);
+    return NULL;
+  }
+  ring->thread_name = "thread";
+  SDL_AtomicSetPtr((void **)&rings[slot], ring);
+  SDL_TLSSet(ring_key, ring, NULL);
+  return ring;
+}
+
+// Name the calling thread in the timeline
+void trace_set_thread_name(const char *name) {
+  trace_ring_t *ring = thread_ring();
+  if (ring) ring->thread_name = name;
+}
+
+trace_zone_t trace_begin(const char *name) {
+  trace_zone_t zone = {.name = name, .begin = SDL_GetPerformanceCounter()};
+  return zone;
+}
+
+void trace_end(trace_zone_t zone) {
+  trace_event(zone.name, zone.begin, SDL_GetPerformanceCounter());
+}
+
+// Record a zone timed elsewhere with the performance counter
+void trace_event(const char *name, uint64_t begin, uint64_t end) {
+  trace_ring_t *ring = thread_ring();
+  if (ring == NULL) return;
+
+  int count = SDL_AtomicGet(&ring->count);
+  trace_event_t *event = &ring->events[count % TRACE_RING_EVENTS];
+  event->name = name;
+  event->begin = begin;
+  event->end = end;
+  SDL_AtomicSet(&ring->count, count + 1);
+}
+
+static double ticks_to_us(uint64_t ticks) {
+  return (double)ticks * 1000000.0 / SDL_GetPerformanceFrequency();
+}
+
+// Write the events of every thread in the Chrome trace event format, which
+// chrome://tracing and Perfetto open. Threads still tracing while the file
+// is written may overwrite their oldest events, each event is copied first
+// and skipped if its slot was reused meanwhile
+bool trace_dump(const char *filename) {
+  FILE *file = fopen(filename, "w");
+  if (file == NULL) return false;
+
+  fprintf(file, "{\"traceEvents\":[\n");
+  bool first = true;
+  int threads = SDL_AtomicGet(&num_rings);
+  if (threads > TRACE_MAX_THREADS) threads = TRACE_MAX_THREADS;
+
+  for (int tid = 0; tid < threads; tid++) {
+    trace_ring_t *ring =
+        (trace_ring_t *)SDL_AtomicGetPtr((void **)&rings[tid]);
+    if (ring == NULL) continue;
+
+    fprintf(file,
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", tid, ring->thread_name);
+    first = false;
+
+    int count = SDL_AtomicGet(&ring->count);
+    int oldest = count > TRACE_RING_EVENTS ? count - TRACE_RING_EVENTS : 0;
+    for (int i = oldest; i < count; i++) {
+      trace_event_t event = ring->events[i % TRACE_RING_EVENTS];
+      if (SDL_AtomicGet(&ring->count) - i >= TRACE_RING_EVENTS) continue;
+      if (event.begin < start_ticks) continue;
+
+      fprintf(file,
+              ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+              "\"ts\":%.3f,\"dur\":%.3f}",
+              event.name, tid, ticks_to_us(event.begin - start_ticks),
+              ticks_to_us(event.end - event.begin));
+    }
+  }
+
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0;
+}
+
+// Free the rings once no thread records events anymore
+void trace_free(void) {
+  int threads = SDL_AtomicGet(&num_rings);
+  if (threads > TRACE_MAX_THREADS) threads = TRACE_MAX_THREADS;
+  for (int i = 0; i < threads; i++) {
+    free(rings[i]);
+    rings[i] = NULL;
+  }
+  SDL_AtomicSet(&num_rings, 0);
+  if (ring_key != 0) SDL_TLSSet(ring_key, NULL, NULL);
+}
@@ -0,0 +1,25 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Events kept per thread, older ones are overwritten
+#define TRACE_RING_EVENTS (1 << 16)
+
+// A zone being timed, closed by trace_end. Names must be string literals, or
+// any string outliving the trace, and are written to the JSON unescaped
+typedef struct {
+  const char *name;
+  uint64_t begin;
+} trace_zone_t;
+
+bool trace_init(void);
+void trace_set_thread_name(const char *name);
+trace_zone_t trace_begin(const char *name);
+void trace_end(trace_zone_t zone);
+void trace_event(const char *name, uint64_t begin, uint64_t end);
+bool trace_dump(const char *filename);
+void trace_free(void);
+
+#endif
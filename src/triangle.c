@@ -1,78 +1,8 @@
 #include "triangle.h"
 
-#include "display.h"
-
-void fill_flat_bottom_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
-                               uint32_t color) {
-  // Calculating the change in x over y. That is why is inverted
-  float inv_slope_1 = (float)(x1 - x0) / (float)(y1 - y0);
-  float inv_slope_2 = (float)(x2 - x0) / (float)(y2 - y0);
-
-  // Start x_start and x_end from the top vertex (x0, y0)
-  float x_start = x0;
-  float x_end = x0;
-
-  // Loop all scanelines from top to bottom
-  for (int y = y0; y <= y2; y++) {
-    draw_line(x_start, y, x_end, y, color);
-    x_start += inv_slope_1;
-    x_end += inv_slope_2;
-  }
-}
-
-void fill_flat_top_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
-                            uint32_t color) {
-  // Calculating the change in x over y. That is why is inverted
-  float inv_slope_1 = (float)(x2 - x0) / (float)(y2 - y0);
-  float inv_slope_2 = (float)(x2 - x1) / (float)(y2 - y1);
-
-  // Start x_start and x_end from the top vertex (x2, y2)
-  float x_start = x2;
-  float x_end = x2;
-
-  // Loop all scanelines from bottom to top
-  for (int y = y2; y >= y0; y--) {
-    draw_line(x_start, y, x_end, y, color);
-    x_start -= inv_slope_1;
-    x_end -= inv_slope_2;
-  }
-}
+#include <math.h>
 
-void draw_filled_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
-                          uint32_t color) {
-  // Sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-  }
-
-  if (y1 > y2) {
-    int_swap(&y1, &y2);
-    int_swap(&x1, &x2);
-  }
-
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-  }
-
-  if (y1 == y2) {
-    // We simply draw the flat-bottom triangle
-    fill_flat_bottom_triangle(x0, y0, x1, y1, x2, y2, color);
-  } else if (y0 == y1) {
-    // We simply draw the flat-top triangle
-    fill_flat_top_triangle(x0, y0, x1, y1, x2, y2, color);
-  } else {
-    // Calculate the new vertex (Mx, My) using triangle similarity
-    int My = y1;
-    int Mx = (((x2 - x0) * (y1 - y0)) / (y2 - y0)) + x0;
-
-    // Draw flat-bottom triangle
-    fill_flat_bottom_triangle(x0, y0, x1, y1, Mx, My, color);
-    // Draw flat-top triangle
-    fill_flat_top_triangle(x1, y1, Mx, My, x2, y2, color);
-  }
-}
+#include "display.h"
 
 void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
                    uint32_t color) {
@@ -109,14 +39,180 @@ vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p) {
   return weights;
 }
 
-void draw_texel(int x, int y, uint32_t *texture, vec4_t point_a, vec4_t point_b,
-                vec4_t point_c, tex2_t a_uv, tex2_t b_uv, tex2_t c_uv) {
+// Test the depth of a pixel against the z-buffer following the current
+// depth_mode, returning true if the pixel should be shaded
+bool depth_test(int x, int y, float depth, pipeline_stats_t *stats) {
+  if (x < 0 || x >= window_width || y < 0 || y >= window_height) return false;
+
+  float *stored_depth = &z_buffer[window_width * y + x];
+
+  if (depth_mode == DEPTH_EQUAL) {
+    if (depth != *stored_depth) return false;
+
+    // Consume the stored depth so a pixel is textured at most once, even
+    // where triangles share an edge or a scanline is visited twice
+    *stored_depth = -1.0;
+    return true;
+  }
+
+  if (depth >= *stored_depth) return false;
+
+  *stored_depth = depth;
+  stats->depth_writes++;
+
+  return depth_mode == DEPTH_LESS;
+}
+
+// Count a pixel shaded, and how many times it was for the overdraw heat map
+void count_pixel_written(int x, int y, pipeline_stats_t *stats) {
+  stats->pixels_written++;
+  if (show_overdraw) {
+    uint8_t *count = &overdraw_buffer[window_width * y + x];
+    if (*count < UINT8_MAX) (*count)++;
+  }
+}
+
+// Corner of a triangle being rasterized, with the attributes interpolated
+// across it already divided by w
+typedef struct {
+  int x;
+  int y;
+  float inv_w;
+  float u_over_w;
+  float v_over_w;
+} triangle_corner_t;
+
+// Load the corners of a triangle from the raster vertices it indexes, sorted
+// by y-coordinate ascending (y0 < y1 < y2)
+void load_sorted_corners(const triangle_t *triangle,
+                         const raster_vertex_t *vertices,
+                         triangle_corner_t corners[3]) {
+  for (int i = 0; i < 3; i++) {
+    const raster_vertex_t *vertex = &vertices[triangle->vertices[i]];
+    corners[i].x = vertex->x;
+    corners[i].y = vertex->y;
+    corners[i].inv_w = vertex->inv_w;
+    corners[i].u_over_w = triangle->uv_over_w[i].u;
+    corners[i].v_over_w = triangle->uv_over_w[i].v;
+  }
+
+  triangle_corner_t temp;
+  if (corners[0].y > corners[1].y) {
+    temp = corners[0];
+    corners[0] = corners[1];
+    corners[1] = temp;
+  }
+  if (corners[1].y > corners[2].y) {
+    temp = corners[1];
+    corners[1] = corners[2];
+    corners[2] = temp;
+  }
+  if (corners[0].y > corners[1].y) {
+    temp = corners[0];
+    corners[0] = corners[1];
+    corners[1] = temp;
+  }
+}
+
+vec3_t corner_weights(const triangle_corner_t *a, const triangle_corner_t *b,
+                      const triangle_corner_t *c, int x, int y) {
+  vec2_t point_a = {.x = a->x, .y = a->y};
+  vec2_t point_b = {.x = b->x, .y = b->y};
+  vec2_t point_c = {.x = c->x, .y = c->y};
   vec2_t point_p = {.x = x, .y = y};
+  return barycentric_weights(point_a, point_b, point_c, point_p);
+}
 
-  vec2_t a = vec2_from_vec4(point_a);
-  vec2_t b = vec2_from_vec4(point_b);
-  vec2_t c = vec2_from_vec4(point_c);
-  vec3_t weights = barycentric_weights(a, b, c, point_p);
+void draw_triangle_pixel(int x, int y, uint32_t color,
+                         const triangle_corner_t *a,
+                         const triangle_corner_t *b,
+                         const triangle_corner_t *c,
+                         pipeline_stats_t *stats) {
+  vec3_t weights = corner_weights(a, b, c, x, y);
+
+  float alpha = weights.x;
+  float beta = weights.y;
+  float gamma = weights.z;
+
+  // Interpolate the value of 1/w for the current pixel
+  float interpolated_reciprocal_w =
+      a->inv_w * alpha + b->inv_w * beta + c->inv_w * gamma;
+
+  // Only draw the pixel if it passes the depth test
+  float depth = 1.0 - interpolated_reciprocal_w;
+  if (!depth_test(x, y, depth, stats)) return;
+
+  draw_pixel(x, y, color);
+  count_pixel_written(x, y, stats);
+}
+
+void draw_filled_triangle(const triangle_t *triangle,
+                          const raster_vertex_t *vertices,
+                          pipeline_stats_t *stats) {
+  stats->triangles_rasterized++;
+
+  triangle_corner_t corners[3];
+  load_sorted_corners(triangle, vertices, corners);
+
+  int x0 = corners[0].x;
+  int y0 = corners[0].y;
+  int x1 = corners[1].x;
+  int y1 = corners[1].y;
+  int x2 = corners[2].x;
+  int y2 = corners[2].y;
+  uint32_t color = triangle->color;
+
+  // Render the upper part of the triangle (flat-bottom)
+  float inv_slope_1 = 0;
+  float inv_slope_2 = 0;
+
+  if (y1 - y0 != 0) inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
+  if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+
+  if (y1 - y0 != 0) {
+    for (int y = y0; y <= y1; y++) {
+      int x_start = x1 + (y - y1) * inv_slope_1;
+      int x_end = x0 + (y - y0) * inv_slope_2;
+
+      if (x_end < x_start) {
+        int_swap(&x_start, &x_end);  // swap if x_start is to the right of x_end
+      }
+
+      for (int x = x_start; x < x_end; x++) {
+        draw_triangle_pixel(x, y, color, &corners[0], &corners[1],
+                            &corners[2], stats);
+      }
+    }
+  }
+
+  // Render the bottom part of the triangle (flat-top)
+  inv_slope_1 = 0;
+  inv_slope_2 = 0;
+
+  if (y2 - y1 != 0) inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
+  if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+
+  if (y2 - y1 != 0) {
+    for (int y = y1; y <= y2; y++) {
+      int x_start = x1 + (y - y1) * inv_slope_1;
+      int x_end = x0 + (y - y0) * inv_slope_2;
+
+      if (x_end < x_start) {
+        int_swap(&x_start, &x_end);  // swap if x_start is to the right of x_end
+      }
+
+      for (int x = x_start; x < x_end; x++) {
+        draw_triangle_pixel(x, y, color, &corners[0], &corners[1],
+                            &corners[2], stats);
+      }
+    }
+  }
+}
+
+void draw_texel(int x, int y, const sampler_t *sampler,
+                const triangle_corner_t *a, const triangle_corner_t *b,
+                const triangle_corner_t *c, pipeline_stats_t *stats) {
+  vec3_t weights = corner_weights(a, b, c, x, y);
 
   float alpha = weights.x;
   float beta = weights.y;
@@ -128,75 +224,110 @@ void draw_texel(int x, int y, uint32_t *texture, vec4_t point_a, vec4_t point_b,
   float interpolated_v;
   float interpolated_reciprocal_w;
 
-  // Perform the interpolation of all U/w and V/w values using barycentric
-  // weights and a factor of 1/w
-  interpolated_u = (a_uv.u / point_a.w) * alpha + (b_uv.u / point_b.w) * beta +
-                   (c_uv.u / point_c.w) * gamma;
-  interpolated_v = (a_uv.v / point_a.w) * alpha + (b_uv.v / point_b.w) * beta +
-                   (c_uv.v / point_c.w) * gamma;
+  interpolated_reciprocal_w =
+      a->inv_w * alpha + b->inv_w * beta + c->inv_w * gamma;
+
+  // Only draw the pixel if it passes the depth test
+  float depth = 1.0 - interpolated_reciprocal_w;
+  if (!depth_test(x, y, depth, stats)) return;
 
-  interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta +
-                              (1 / point_c.w) * gamma;
+  // Perform the interpolation of all U/w and V/w values using barycentric
+  // weights, they were divided by w when the triangle was set up
+  interpolated_u =
+      a->u_over_w * alpha + b->u_over_w * beta + c->u_over_w * gamma;
+  interpolated_v =
+      a->v_over_w * alpha + b->v_over_w * beta + c->v_over_w * gamma;
 
   // Now we can divide back both interpolated values by 1/w
   interpolated_u /= interpolated_reciprocal_w;
   interpolated_v /= interpolated_reciprocal_w;
 
-  // Map the UV coordinate to the full texture width and height
-  int tex_x = abs((int)(interpolated_u * texture_width));
-  int tex_y = abs((int)(interpolated_v * texture_height));
+  // Sample the texture at the UV coordinate with the filter and mip levels
+  // chosen for the triangle
+  draw_pixel(x, y, sampler_fetch(sampler, interpolated_u, interpolated_v));
+  count_pixel_written(x, y, stats);
+}
 
-  // Preventing exceeding the size of the texture
-  int pos =
-      ((texture_width * tex_y) + tex_x) % (texture_width * texture_height);
+// Find the level of detail whose texels best match the size of the pixels
+// covered by the triangle, comparing its area in texels of level 0 with its
+// area on screen (each level has a quarter of the texels of the previous one)
+float triangle_texture_lod(int x0, int y0, float u0, float v0, int x1, int y1,
+                           float u1, float v1, int x2, int y2, float u2,
+                           float v2, const texture_t *texture) {
+  float screen_area = fabs((float)(x1 - x0) * (y2 - y0) -
+                           (float)(x2 - x0) * (y1 - y0));
+  float texel_area = fabs((u1 - u0) * (v2 - v0) - (u2 - u0) * (v1 - v0)) *
+                     texture->mipmaps[0].width * texture->mipmaps[0].height;
 
-  draw_pixel(x, y, texture[pos]);
+  if (screen_area <= 0 || texel_area <= screen_area) return 0;
+
+  return 0.5 * log2(texel_area / screen_area);
 }
 
-void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0,
-                            float v0, int x1, int y1, float z1, float w1,
-                            float u1, float v1, int x2, int y2, float z2,
-                            float w2, float u2, float v2, uint32_t *texture) {
-  // We need to sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-    float_swap(&z0, &z1);
-    float_swap(&w0, &w1);
-    float_swap(&u0, &u1);
-    float_swap(&v0, &v1);
-  }
-  if (y1 > y2) {
-    int_swap(&y1, &y2);
-    int_swap(&x1, &x2);
-    float_swap(&z1, &z2);
-    float_swap(&w1, &w2);
-    float_swap(&u1, &u2);
-    float_swap(&v1, &v2);
-  }
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-    float_swap(&z0, &z1);
-    float_swap(&w0, &w1);
-    float_swap(&u0, &u1);
-    float_swap(&v0, &v1);
+// Fill the attributes of a render queue triangle that only depend on its
+// vertices, so rasterizing it divides nothing per pixel. The texture may be
+// NULL for untextured meshes
+void triangle_setup(triangle_t *triangle, const raster_vertex_t *vertices,
+                    const tex2_t uvs[3], const texture_t *texture) {
+  int x[3];
+  int y[3];
+  float v[3];
+  for (int i = 0; i < 3; i++) {
+    const raster_vertex_t *vertex = &vertices[triangle->vertices[i]];
+    x[i] = vertex->x;
+    y[i] = vertex->y;
+
+    // Flip the v component to account for inverted UV-coordinates (v grows
+    // downwards)
+    v[i] = 1.0 - uvs[i].v;
+
+    triangle->uv_over_w[i].u = uvs[i].u * vertex->inv_w;
+    triangle->uv_over_w[i].v = v[i] * vertex->inv_w;
   }
 
-  // Flip the v component to account for inverted UV-coordinates (v grows
-  // downwards)
-  v0 = 1.0 - v0;
-  v1 = 1.0 - v1;
-  v2 = 1.0 - v2;
-
-  // Create vector points and texture coords after we sort the vertices
-  vec4_t point_a = {x0, y0, z0, w0};
-  vec4_t point_b = {x1, y1, z1, w1};
-  vec4_t point_c = {x2, y2, z2, w2};
+  triangle->lod = 0;
+  if (texture != NULL && texture->num_mipmaps > 0) {
+    triangle->lod =
+        triangle_texture_lod(x[0], y[0], uvs[0].u, v[0], x[1], y[1], uvs[1].u,
+                             v[1], x[2], y[2], uvs[2].u, v[2], texture);
+  }
+}
 
-  tex2_t a_uv = {u0, v0};
-  tex2_t b_uv = {u1, v1};
-  tex2_t c_uv = {u2, v2};
+// Draw a triangle sampling the texture. Compressed levels are decoded
+// through the block cache of the calling thread, which may be NULL
+void draw_textured_triangle(const triangle_t *triangle,
+                            const raster_vertex_t *vertices,
+                            const texture_t *texture,
+                            texture_block_cache_t *block_cache,
+                            pipeline_stats_t *stats) {
+  if (texture == NULL || texture->num_mipmaps == 0) return;
+  stats->triangles_rasterized++;
+  unsigned long pixels_before = stats->pixels_written;
+
+  triangle_corner_t corners[3];
+  load_sorted_corners(triangle, vertices, corners);
+
+  int x0 = corners[0].x;
+  int y0 = corners[0].y;
+  int x1 = corners[1].x;
+  int y1 = corners[1].y;
+  int x2 = corners[2].x;
+  int y2 = corners[2].y;
+
+  // Sample with the same mip levels for the whole triangle
+  sampler_t sampler = make_sampler(texture, triangle->lod, texture_filter);
+
+  // Pixels next to each other, and the triangles next to them, sample the
+  // same blocks of compressed levels, so each block is decoded once for all
+  // of them. The blocks decoded for another texture are dropped
+  if (block_cache &&
+      (sampler.mipmap->blocks || sampler.next_mipmap->blocks)) {
+    if (block_cache->texture != texture) {
+      texture_block_cache_clear(block_cache);
+      block_cache->texture = texture;
+    }
+    sampler.block_cache = block_cache;
+  }
 
   // Render the upper part of the triangle (flat-bottom)
 
@@ -217,7 +348,8 @@ void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0,
 
       for (int x = x_start; x < x_end; x++) {
         // Draw our pixel with the color that comes from the texture
-        draw_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
+        draw_texel(x, y, &sampler, &corners[0], &corners[1], &corners[2],
+                   stats);
       }
     }
   }
@@ -240,8 +372,49 @@ void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0,
 
       for (int x = x_start; x < x_end; x++) {
         // Draw our pixel with the color that comes from the texture
-        draw_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
+        draw_texel(x, y, &sampler, &corners[0], &corners[1], &corners[2],
+                   stats);
       }
     }
   }
-}
\ No newline at end of file
+
+  stats->texels_fetched += (stats->pixels_written - pixels_before) *
+                           sampler_texels_per_fetch(&sampler);
+}
+
+bounds_t triangle_bounds(const triangle_t *triangle,
+                         const raster_vertex_t *vertices) {
+  const raster_vertex_t *first = &vertices[triangle->vertices[0]];
+  bounds_t bounds = {.min_x = first->x,
+                     .min_y = first->y,
+                     .max_x = first->x,
+                     .max_y = first->y,
+                     .min_depth = 1.0};
+
+  for (int i = 0; i < 3; i++) {
+    const raster_vertex_t *vertex = &vertices[triangle->vertices[i]];
+    int x = vertex->x;
+    int y = vertex->y;
+    if (x < bounds.min_x) bounds.min_x = x;
+    if (y < bounds.min_y) bounds.min_y = y;
+    if (x > bounds.max_x) bounds.max_x = x;
+    if (y > bounds.max_y) bounds.max_y = y;
+
+    // A vertex behind the camera has no meaningful depth, so the triangle
+    // must never be considered occluded
+    float depth = vertex->inv_w > 0 ? 1.0 - vertex->inv_w : 0.0;
+    if (depth < bounds.min_depth) bounds.min_depth = depth;
+  }
+
+  return bounds;
+}
+
+bounds_t bounds_merge(bounds_t a, bounds_t b) {
+  bounds_t bounds = {
+      .min_x = a.min_x < b.min_x ? a.min_x : b.min_x,
+      .min_y = a.min_y < b.min_y ? a.min_y : b.min_y,
+      .max_x = a.max_x > b.max_x ? a.max_x : b.max_x,
+      .max_y = a.max_y > b.max_y ? a.max_y : b.max_y,
+      .min_depth = a.min_depth < b.min_depth ? a.min_depth : b.min_depth};
+  return bounds;
+}
@@ -1,9 +1,11 @@
 #ifndef TRIANGLE_H
 #define TRIANGLE_H
 
+#include "stats.h"
 #include "swap.h"
 #include "texture.h"
 #include "vector.h"
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct {
@@ -16,21 +18,61 @@ typedef struct {
   uint32_t color;
 } face_t;
 
+// Screen position (in the whole pixels the rasterizers work with) and 1/w of
+// a projected vertex, shared by every triangle of the frame using it
 typedef struct {
-  vec4_t points[3];
-  tex2_t texcoords[3];
+  int x;
+  int y;
+  float inv_w;
+} raster_vertex_t;
+
+// Triangle of the render queue, set up once by triangle_setup so that
+// rasterizing it needs no per-pixel divisions for its attributes
+typedef struct {
+  uint32_t vertices[3];  // Indices into the raster vertices of the frame
+  tex2_t uv_over_w[3];   // Texture coordinates (v flipped) times 1/w
   uint32_t color;
   float avg_depth;
+  float lod;  // Texture level of detail sampled across the triangle
 } triangle_t;
 
+// Screen-space bounding rectangle (inclusive) and nearest depth (1 - 1/w) of
+// one or more triangles, used to test them against the hierarchical z-buffer
+typedef struct {
+  int min_x;
+  int min_y;
+  int max_x;
+  int max_y;
+  float min_depth;
+} bounds_t;
+
+// Run of consecutive triangles in the render list that is tested for
+// occlusion as a whole before any of its triangles is set up
+typedef struct {
+  int first;
+  int count;
+  bounds_t bounds;
+  const texture_t *texture;  // Texture of the mesh, NULL when it has none
+} cluster_t;
+
+vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p);
+
+bounds_t triangle_bounds(const triangle_t *triangle,
+                         const raster_vertex_t *vertices);
+bounds_t bounds_merge(bounds_t a, bounds_t b);
+
 void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
                    uint32_t color);
-void draw_filled_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
-                          uint32_t color);
+void draw_filled_triangle(const triangle_t *triangle,
+                          const raster_vertex_t *vertices,
+                          pipeline_stats_t *stats);
 
-void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0,
-                            float v0, int x1, int y1, float z1, float w1,
-                            float u1, float v1, int x2, int y2, float z2,
-                            float w2, float u2, float v2, uint32_t *texture);
+void triangle_setup(triangle_t *triangle, const raster_vertex_t *vertices,
+                    const tex2_t uvs[3], const texture_t *texture);
+void draw_textured_triangle(const triangle_t *triangle,
+                            const raster_vertex_t *vertices,
+                            const texture_t *texture,
+                            texture_block_cache_t *block_cache,
+                            pipeline_stats_t *stats);
 
 #endif
\ No newline at end of file
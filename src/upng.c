@@ -28,6 +28,14 @@ freely, subject to the following restrictions:
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 
 #include "upng.h"
 
@@ -47,14 +55,17 @@ freely, subject to the following restrictions:
 #define NUM_CODE_LENGTH_CODES 19	/*the code length codes. 0-15: code lengths, 16: copy previous 3-6 times, 17: 3-10 zeros, 18: 11-138 zeros */
 #define MAX_SYMBOLS 288 /* largest number of symbols used by any tree type */
 
-#define DEFLATE_CODE_BITLEN 15
-#define DISTANCE_BITLEN 15
-#define CODE_LENGTH_BITLEN 7
 #define MAX_BIT_LENGTH 15 /* largest bitlen used by any tree type */
 
-#define DEFLATE_CODE_BUFFER_SIZE (NUM_DEFLATE_CODE_SYMBOLS * 2)
-#define DISTANCE_BUFFER_SIZE (NUM_DISTANCE_SYMBOLS * 2)
-#define CODE_LENGTH_BUFFER_SIZE (NUM_DISTANCE_SYMBOLS * 2)
+#define HUFFMAN_FAST_BITS 10	/* codes up to this length are decoded with a single table lookup */
+#define HUFFMAN_FAST_SIZE (1 << HUFFMAN_FAST_BITS)
+#define HUFFMAN_FAST_LENGTH_SHIFT 9	/* fast table entries hold the symbol in the low 9 bits and the code length above them */
+#define HUFFMAN_FAST_SYMBOL_MASK 0x1FF
+
+#define WINDOW_SIZE 65536	/* twice the 32 KB deflate window, so pending output never overwrites bytes a back-reference can reach */
+#define WINDOW_MASK (WINDOW_SIZE - 1)
+#define WINDOW_FLUSH 32768	/* inflated bytes are passed on to the scanlines once this many are pending */
+#define READ_SIZE 65536	/* bytes of IDAT data read from a file at a time */
 
 #define SET_ERROR(upng,code) do { (upng)->error = (code); (upng)->error_line = __LINE__; } while (0)
 
@@ -80,6 +91,9 @@ typedef struct upng_source {
 	const unsigned char*	buffer;
 	unsigned long			size;
 	char					owning;
+	FILE*					file;	/* read a piece at a time while decoding, instead of buffer */
+	unsigned long			pos;	/* next byte of buffer to read */
+	uint64_t				file_hash;	/* FNV-1a hash of the bytes read from file so far */
 } upng_source;
 
 struct upng_t {
@@ -98,14 +112,55 @@ struct upng_t {
 
 	upng_state		state;
 	upng_source		source;
+	upng_output		output;
+
+	uint64_t		file_hash;	/* FNV-1a hash of the whole file, once decoded */
 };
 
+/* canonical Huffman code of one alphabet. Codes of up to HUFFMAN_FAST_BITS bits are decoded with one lookup in fast, indexed by the next input bits, longer codes are decoded from the number of codes of each length */
 typedef struct huffman_tree {
-	unsigned* tree2d;
-	unsigned maxbitlen;	/*maximum number of bits a single code can get */
-	unsigned numcodes;	/*number of symbols in the alphabet = number of codes */
+	unsigned short fast[HUFFMAN_FAST_SIZE];	/* symbol and length of the code the index bits start with, 0 when that code is longer */
+	unsigned short count[MAX_BIT_LENGTH + 1];	/* number of codes of each length */
+	unsigned short symbol[MAX_SYMBOLS];	/* symbols ordered by their code */
 } huffman_tree;
 
+/* reads the bits of the compressed data (least significant bit of each byte first) through a 64-bit buffer refilled with whole bytes, so most reads need no memory access */
+typedef struct bit_reader {
+	const unsigned char* in;	/* current piece of the IDAT data */
+	unsigned long inlength;
+	unsigned long pos;	/* next byte of in to load into the buffer */
+	uint64_t buffer;	/* loaded bits not read yet, the next one is the lowest */
+	unsigned count;	/* number of loaded bits in buffer */
+
+	upng_t* upng;	/* source of the next pieces of the IDAT chunks */
+	unsigned char* file_buffer;	/* READ_SIZE bytes holding the piece read from a file */
+	unsigned long idat_left;	/* bytes of the current IDAT chunk not read yet */
+	int in_idat;	/* the CRC of an IDAT chunk comes before the next chunk */
+	int ended;	/* no more IDAT data */
+} bit_reader;
+
+/* receives the inflated data and unfilters it one scanline at a time straight into the decoded image */
+typedef struct scanline_sink {
+	unsigned char* out;	/* the decoded image */
+	unsigned char* lines;	/* two scanlines with their filter byte, filled and previous one */
+	unsigned char* line;	/* scanline being filled */
+	unsigned char* prevline;	/* previous unfiltered scanline, NULL for the first one */
+	unsigned long linebytes;	/* bytes of a scanline without its filter byte */
+	unsigned long bytewidth;	/* bytes per pixel for filtering, 1 when pixels are smaller than a byte */
+	unsigned long fill;	/* bytes of line filled, including the filter byte */
+	unsigned y;	/* scanline being filled */
+} scanline_sink;
+
+/* the last WINDOW_SIZE inflated bytes, addressed by their position in the whole output modulo WINDOW_SIZE */
+typedef struct inflate_window {
+	unsigned char* data;
+	unsigned long pos;	/* number of bytes inflated */
+	unsigned long flushed;	/* number of bytes passed on to the sink */
+	scanline_sink* sink;
+} inflate_window;
+
+static void scanline_sink_write(upng_t* upng, scanline_sink* sink, const unsigned char* data, unsigned long size);
+
 static const unsigned LENGTH_BASE[29] = {	/*the base lengths represented by codes 257-285 */
 	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
 	67, 83, 99, 115, 131, 163, 195, 227, 258
@@ -129,173 +184,334 @@ static const unsigned DISTANCE_EXTRA[30] = {	/*the extra bits of backwards dista
 static const unsigned CLCL[NUM_CODE_LENGTH_CODES]	/*the order in which "code length alphabet code lengths" are stored, out of this the huffman tree of the dynamic huffman tree lengths is generated */
 = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
-static const unsigned FIXED_DEFLATE_CODE_TREE[NUM_DEFLATE_CODE_SYMBOLS * 2] = {
-	289, 370, 290, 307, 546, 291, 561, 292, 293, 300, 294, 297, 295, 296, 0, 1,
-	2, 3, 298, 299, 4, 5, 6, 7, 301, 304, 302, 303, 8, 9, 10, 11, 305, 306, 12,
-	13, 14, 15, 308, 339, 309, 324, 310, 317, 311, 314, 312, 313, 16, 17, 18,
-	19, 315, 316, 20, 21, 22, 23, 318, 321, 319, 320, 24, 25, 26, 27, 322, 323,
-	28, 29, 30, 31, 325, 332, 326, 329, 327, 328, 32, 33, 34, 35, 330, 331, 36,
-	37, 38, 39, 333, 336, 334, 335, 40, 41, 42, 43, 337, 338, 44, 45, 46, 47,
-	340, 355, 341, 348, 342, 345, 343, 344, 48, 49, 50, 51, 346, 347, 52, 53,
-	54, 55, 349, 352, 350, 351, 56, 57, 58, 59, 353, 354, 60, 61, 62, 63, 356,
-	363, 357, 360, 358, 359, 64, 65, 66, 67, 361, 362, 68, 69, 70, 71, 364,
-	367, 365, 366, 72, 73, 74, 75, 368, 369, 76, 77, 78, 79, 371, 434, 372,
-	403, 373, 388, 374, 381, 375, 378, 376, 377, 80, 81, 82, 83, 379, 380, 84,
-	85, 86, 87, 382, 385, 383, 384, 88, 89, 90, 91, 386, 387, 92, 93, 94, 95,
-	389, 396, 390, 393, 391, 392, 96, 97, 98, 99, 394, 395, 100, 101, 102, 103,
-	397, 400, 398, 399, 104, 105, 106, 107, 401, 402, 108, 109, 110, 111, 404,
-	419, 405, 412, 406, 409, 407, 408, 112, 113, 114, 115, 410, 411, 116, 117,
-	118, 119, 413, 416, 414, 415, 120, 121, 122, 123, 417, 418, 124, 125, 126,
-	127, 420, 427, 421, 424, 422, 423, 128, 129, 130, 131, 425, 426, 132, 133,
-	134, 135, 428, 431, 429, 430, 136, 137, 138, 139, 432, 433, 140, 141, 142,
-	143, 435, 483, 436, 452, 568, 437, 438, 445, 439, 442, 440, 441, 144, 145,
-	146, 147, 443, 444, 148, 149, 150, 151, 446, 449, 447, 448, 152, 153, 154,
-	155, 450, 451, 156, 157, 158, 159, 453, 468, 454, 461, 455, 458, 456, 457,
-	160, 161, 162, 163, 459, 460, 164, 165, 166, 167, 462, 465, 463, 464, 168,
-	169, 170, 171, 466, 467, 172, 173, 174, 175, 469, 476, 470, 473, 471, 472,
-	176, 177, 178, 179, 474, 475, 180, 181, 182, 183, 477, 480, 478, 479, 184,
-	185, 186, 187, 481, 482, 188, 189, 190, 191, 484, 515, 485, 500, 486, 493,
-	487, 490, 488, 489, 192, 193, 194, 195, 491, 492, 196, 197, 198, 199, 494,
-	497, 495, 496, 200, 201, 202, 203, 498, 499, 204, 205, 206, 207, 501, 508,
-	502, 505, 503, 504, 208, 209, 210, 211, 506, 507, 212, 213, 214, 215, 509,
-	512, 510, 511, 216, 217, 218, 219, 513, 514, 220, 221, 222, 223, 516, 531,
-	517, 524, 518, 521, 519, 520, 224, 225, 226, 227, 522, 523, 228, 229, 230,
-	231, 525, 528, 526, 527, 232, 233, 234, 235, 529, 530, 236, 237, 238, 239,
-	532, 539, 533, 536, 534, 535, 240, 241, 242, 243, 537, 538, 244, 245, 246,
-	247, 540, 543, 541, 542, 248, 249, 250, 251, 544, 545, 252, 253, 254, 255,
-	547, 554, 548, 551, 549, 550, 256, 257, 258, 259, 552, 553, 260, 261, 262,
-	263, 555, 558, 556, 557, 264, 265, 266, 267, 559, 560, 268, 269, 270, 271,
-	562, 565, 563, 564, 272, 273, 274, 275, 566, 567, 276, 277, 278, 279, 569,
-	572, 570, 571, 280, 281, 282, 283, 573, 574, 284, 285, 286, 287, 0, 0
-};
+/* read up to size bytes of the PNG from its file or from memory, returning how many were read. Every byte read from a file goes through the hash, so the file is hashed in the same pass that decodes it */
+static unsigned long source_read(upng_t* upng, unsigned char* buffer, unsigned long size)
+{
+	if (upng->source.file != NULL) {
+		unsigned long i;
+		uint64_t hash = upng->source.file_hash;
+
+		size = (unsigned long)fread(buffer, 1, size, upng->source.file);
+		for (i = 0; i < size; i++) {
+			hash ^= buffer[i];
+			hash *= 0x100000001B3ULL;
+		}
+		upng->source.file_hash = hash;
+		return size;
+	}
 
-static const unsigned FIXED_DISTANCE_TREE[NUM_DISTANCE_SYMBOLS * 2] = {
-	33, 48, 34, 41, 35, 38, 36, 37, 0, 1, 2, 3, 39, 40, 4, 5, 6, 7, 42, 45, 43,
-	44, 8, 9, 10, 11, 46, 47, 12, 13, 14, 15, 49, 56, 50, 53, 51, 52, 16, 17,
-	18, 19, 54, 55, 20, 21, 22, 23, 57, 60, 58, 59, 24, 25, 26, 27, 61, 62, 28,
-	29, 30, 31, 0, 0
-};
+	if (size > upng->source.size - upng->source.pos) {
+		size = upng->source.size - upng->source.pos;
+	}
+	memcpy(buffer, upng->source.buffer + upng->source.pos, size);
+	upng->source.pos += size;
+	return size;
+}
 
-static unsigned char read_bit(unsigned long *bitpointer, const unsigned char *bitstream)
+/* skipped bytes of a file are still read, to hash them */
+static int source_skip(upng_t* upng, unsigned long size)
 {
-	unsigned char result = (unsigned char)((bitstream[(*bitpointer) >> 3] >> ((*bitpointer) & 0x7)) & 1);
-	(*bitpointer)++;
-	return result;
+	if (upng->source.file != NULL) {
+		unsigned char buffer[256];
+
+		while (size > 0) {
+			unsigned long piece = size < sizeof(buffer) ? size : sizeof(buffer);
+			if (source_read(upng, buffer, piece) != piece) {
+				return 0;
+			}
+			size -= piece;
+		}
+		return 1;
+	}
+
+	if (size > upng->source.size - upng->source.pos) {
+		return 0;
+	}
+	upng->source.pos += size;
+	return 1;
 }
 
-static unsigned read_bits(unsigned long *bitpointer, const unsigned char *bitstream, unsigned long nbits)
+static void bit_reader_init(bit_reader* reader, upng_t* upng, unsigned char* file_buffer)
 {
-	unsigned result = 0, i;
-	for (i = 0; i < nbits; i++)
-		result |= ((unsigned)read_bit(bitpointer, bitstream)) << i;
-	return result;
+	reader->in = NULL;
+	reader->inlength = 0;
+	reader->pos = 0;
+	reader->buffer = 0;
+	reader->count = 0;
+
+	reader->upng = upng;
+	reader->file_buffer = file_buffer;
+	reader->idat_left = 0;
+	reader->in_idat = 0;
+	reader->ended = 0;
+}
+
+/* move on to the next piece of the IDAT chunks, skipping the other chunks between them. Returns 0 at the end of the image data */
+static int bit_reader_next_input(bit_reader* reader)
+{
+	upng_t* upng = reader->upng;
+	unsigned long size;
+
+	while (reader->idat_left == 0) {
+		unsigned char header[8];
+		unsigned long length;
+
+		if (reader->ended) {
+			return 0;
+		}
+
+		/* skip the CRC of the IDAT chunk just read */
+		if (reader->in_idat) {
+			reader->in_idat = 0;
+			if (!source_skip(upng, 4)) {
+				reader->ended = 1;
+				return 0;
+			}
+		}
+
+		/* a missing IEND only matters if the image data is incomplete, which inflate reports */
+		if (source_read(upng, header, 8) != 8) {
+			reader->ended = 1;
+			return 0;
+		}
+
+		/* get length; sanity check it */
+		length = upng_chunk_length(header);
+		if (length > INT_MAX) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			reader->ended = 1;
+			return 0;
+		}
+
+		/* parse chunks */
+		if (upng_chunk_type(header) == CHUNK_IDAT) {
+			reader->idat_left = length;
+			reader->in_idat = 1;
+		} else if (upng_chunk_type(header) == CHUNK_IEND) {
+			reader->ended = 1;
+			return 0;
+		} else if (upng_chunk_critical(header)) {
+			SET_ERROR(upng, UPNG_EUNSUPPORTED);
+			reader->ended = 1;
+			return 0;
+		} else if (!source_skip(upng, length + 4)) {
+			reader->ended = 1;
+			return 0;
+		}
+	}
+
+	/* files are read a piece at a time, memory is read in place */
+	size = reader->idat_left;
+	if (upng->source.file != NULL) {
+		if (size > READ_SIZE) {
+			size = READ_SIZE;
+		}
+		size = source_read(upng, reader->file_buffer, size);
+		reader->in = reader->file_buffer;
+	} else {
+		if (size > upng->source.size - upng->source.pos) {
+			size = upng->source.size - upng->source.pos;
+		}
+		reader->in = upng->source.buffer + upng->source.pos;
+		upng->source.pos += size;
+	}
+
+	/* error: the chunk is cut short */
+	if (size == 0) {
+		reader->ended = 1;
+		return 0;
+	}
+
+	reader->idat_left -= size;
+	reader->inlength = size;
+	reader->pos = 0;
+	return 1;
 }
 
-/* the buffer must be numcodes*2 in size! */
-static void huffman_tree_init(huffman_tree* tree, unsigned* buffer, unsigned numcodes, unsigned maxbitlen)
+/* load whole bytes into the bit buffer until it holds at least 56 bits or the image data ends */
+static void bit_reader_refill(bit_reader* reader)
 {
-	tree->tree2d = buffer;
+	if (reader->pos + 8 <= reader->inlength) {
+		/* load 8 bytes at once and only count the ones that fit. The bits of the partial
+		   byte above count are the same bits the next refill loads there again */
+		const unsigned char* p = reader->in + reader->pos;
+		uint64_t word = (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+			((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+
+		reader->buffer |= word << reader->count;
+		reader->pos += (63 - reader->count) >> 3;
+		reader->count |= 56;
+		return;
+	}
 
-	tree->numcodes = numcodes;
-	tree->maxbitlen = maxbitlen;
+	while (reader->count <= 56) {
+		if (reader->pos == reader->inlength && !bit_reader_next_input(reader)) {
+			break;
+		}
+		reader->buffer |= (uint64_t)reader->in[reader->pos++] << reader->count;
+		reader->count += 8;
+	}
 }
 
-/*given the code lengths (as stored in the PNG file), generate the tree as defined by Deflate. maxbitlen is the maximum bits that a code in the tree can have. return value is error.*/
-static void huffman_tree_create_lengths(upng_t* upng, huffman_tree* tree, const unsigned *bitlen)
+/* read up to 32 bits, the first one read is the least significant */
+static unsigned read_bits(upng_t* upng, bit_reader* reader, unsigned nbits)
 {
-	unsigned tree1d[MAX_SYMBOLS];
-	unsigned blcount[MAX_BIT_LENGTH];
-	unsigned nextcode[MAX_BIT_LENGTH+1];
-	unsigned bits, n, i;
-	unsigned nodefilled = 0;	/*up to which node it is filled */
-	unsigned treepos = 0;	/*position in the tree (1 of the numcodes columns) */
+	unsigned result;
 
-	/* initialize local vectors */
-	memset(blcount, 0, sizeof(blcount));
-	memset(nextcode, 0, sizeof(nextcode));
+	if (reader->count < nbits) {
+		bit_reader_refill(reader);
 
-	/*step 1: count number of instances of each code length */
-	for (bits = 0; bits < tree->numcodes; bits++) {
-		blcount[bitlen[bits]]++;
+		/* error: the bits go past the end of the input */
+		if (reader->count < nbits) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return 0;
+		}
 	}
 
-	/*step 2: generate the nextcode values */
-	for (bits = 1; bits <= tree->maxbitlen; bits++) {
-		nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
+	result = (unsigned)(reader->buffer & (((uint64_t)1 << nbits) - 1));
+	reader->buffer >>= nbits;
+	reader->count -= nbits;
+	return result;
+}
+
+/*given the code lengths (as stored in the PNG file), generate the canonical code as defined by Deflate: the symbols ordered by code, the number of codes of each length and the fast lookup table of the short codes*/
+static void huffman_tree_create_lengths(upng_t* upng, huffman_tree* tree, const unsigned *bitlen, unsigned numcodes)
+{
+	unsigned offset[MAX_BIT_LENGTH + 1];
+	unsigned nextcode[MAX_BIT_LENGTH + 1];
+	unsigned bits, n, i;
+	int left = 1;
+
+	memset(tree->count, 0, sizeof(tree->count));
+	memset(tree->fast, 0, sizeof(tree->fast));
+
+	/*step 1: count number of instances of each code length */
+	for (n = 0; n < numcodes; n++) {
+		tree->count[bitlen[n]]++;
 	}
+	tree->count[0] = 0;
 
-	/*step 3: generate all the codes */
-	for (n = 0; n < tree->numcodes; n++) {
-		if (bitlen[n] != 0) {
-			tree1d[n] = nextcode[bitlen[n]]++;
+	/* error: oversubscribed, there are more codes than bit patterns of their lengths.
+	   Incomplete codes are allowed, decoding one of their missing patterns fails */
+	for (bits = 1; bits <= MAX_BIT_LENGTH; bits++) {
+		left = (left << 1) - tree->count[bits];
+		if (left < 0) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
 		}
 	}
 
-	/*convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means uninited, a value >= numcodes is an address to another bit, a value < numcodes is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as many columns as codes - 1
-	   a good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes. Here, the internal nodes are stored (what their 0 and 1 option point to). There is only memory for such good tree currently, if there are more nodes (due to too long length codes), error 55 will happen */
-	for (n = 0; n < tree->numcodes * 2; n++) {
-		tree->tree2d[n] = 32767;	/*32767 here means the tree2d isn't filled there yet */
+	/*step 2: generate the first code and the first slot in the symbol order of each length */
+	nextcode[0] = 0;
+	offset[0] = 0;
+	for (bits = 1; bits <= MAX_BIT_LENGTH; bits++) {
+		nextcode[bits] = (nextcode[bits - 1] + tree->count[bits - 1]) << 1;
+		offset[bits] = offset[bits - 1] + tree->count[bits - 1];
 	}
 
-	for (n = 0; n < tree->numcodes; n++) {	/*the codes */
-		for (i = 0; i < bitlen[n]; i++) {	/*the bits for this code */
-			unsigned char bit = (unsigned char)((tree1d[n] >> (bitlen[n] - i - 1)) & 1);
-			/* check if oversubscribed */
-			if (treepos > tree->numcodes - 2) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
-			}
+	/*step 3: assign all the codes */
+	for (n = 0; n < numcodes; n++) {
+		unsigned length = bitlen[n];
+		if (length == 0) {
+			continue;
+		}
 
-			if (tree->tree2d[2 * treepos + bit] == 32767) {	/*not yet filled in */
-				if (i + 1 == bitlen[n]) {	/*last bit */
-					tree->tree2d[2 * treepos + bit] = n;	/*put the current code in it */
-					treepos = 0;
-				} else {	/*put address of the next step in here, first that address has to be found of course (it's just nodefilled + 1)... */
-					nodefilled++;
-					tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;	/*addresses encoded with numcodes added to it */
-					treepos = nodefilled;
-				}
-			} else {
-				treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
+		tree->symbol[offset[length]++] = (unsigned short)n;
+
+		/* Deflate stores codes starting from their most significant bit, so the table is
+		   indexed by the reversed code, and every index starting with it decodes to it */
+		if (length <= HUFFMAN_FAST_BITS) {
+			unsigned code = nextcode[length], reversed = 0;
+			for (i = 0; i < length; i++) {
+				reversed |= ((code >> i) & 1) << (length - 1 - i);
+			}
+			for (i = reversed; i < HUFFMAN_FAST_SIZE; i += 1u << length) {
+				tree->fast[i] = (unsigned short)(n | (length << HUFFMAN_FAST_LENGTH_SHIFT));
 			}
 		}
+
+		nextcode[length]++;
 	}
+}
 
-	for (n = 0; n < tree->numcodes * 2; n++) {
-		if (tree->tree2d[n] == 32767) {
-			tree->tree2d[n] = 0;	/*remove possible remaining 32767's */
+/* the fixed trees of compressed blocks of type 1 */
+static void huffman_tree_create_fixed(upng_t* upng, huffman_tree* codetree, huffman_tree* codetreeD)
+{
+	unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
+	unsigned bitlenD[NUM_DISTANCE_SYMBOLS];
+	unsigned n;
+
+	for (n = 0; n < NUM_DEFLATE_CODE_SYMBOLS; n++) {
+		if (n < 144 || n >= 280) {
+			bitlen[n] = 8;
+		} else if (n < 256) {
+			bitlen[n] = 9;
+		} else {
+			bitlen[n] = 7;
 		}
 	}
+	for (n = 0; n < NUM_DISTANCE_SYMBOLS; n++) {
+		bitlenD[n] = 5;
+	}
+
+	huffman_tree_create_lengths(upng, codetree, bitlen, NUM_DEFLATE_CODE_SYMBOLS);
+	huffman_tree_create_lengths(upng, codetreeD, bitlenD, NUM_DISTANCE_SYMBOLS);
 }
 
-static unsigned huffman_decode_symbol(upng_t *upng, const unsigned char *in, unsigned long *bp, const huffman_tree* codetree, unsigned long inlength)
+/* decode a code longer than HUFFMAN_FAST_BITS one bit at a time: the codes of each length are consecutive numbers following the codes of the previous lengths */
+static unsigned huffman_decode_slow(upng_t *upng, bit_reader* reader, const huffman_tree* codetree)
 {
-	unsigned treepos = 0, ct;
-	unsigned char bit;
-	for (;;) {
-		/* error: end of input memory reached without endcode */
-		if (((*bp) & 0x07) == 0 && ((*bp) >> 3) > inlength) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return 0;
-		}
+	int code = 0, first = 0, index = 0;
+	unsigned length;
 
-		bit = read_bit(bp, in);
+	for (length = 1; length <= MAX_BIT_LENGTH && length <= reader->count; length++) {
+		int count = codetree->count[length];
 
-		ct = codetree->tree2d[(treepos << 1) | bit];
-		if (ct < codetree->numcodes) {
-			return ct;
+		code |= (int)((reader->buffer >> (length - 1)) & 1);
+		if (code - count < first) {
+			reader->buffer >>= length;
+			reader->count -= length;
+			return codetree->symbol[index + (code - first)];
 		}
 
-		treepos = ct - codetree->numcodes;
-		if (treepos >= codetree->numcodes) {
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+
+	/* error: end of input memory reached without endcode, or a pattern without code */
+	SET_ERROR(upng, UPNG_EMALFORMED);
+	return 0;
+}
+
+static unsigned huffman_decode_symbol(upng_t *upng, bit_reader* reader, const huffman_tree* codetree)
+{
+	unsigned entry;
+
+	if (reader->count < MAX_BIT_LENGTH) {
+		bit_reader_refill(reader);
+	}
+
+	entry = codetree->fast[reader->buffer & (HUFFMAN_FAST_SIZE - 1)];
+	if (entry != 0) {
+		unsigned length = entry >> HUFFMAN_FAST_LENGTH_SHIFT;
+
+		/* error: end of input memory reached without endcode */
+		if (length > reader->count) {
 			SET_ERROR(upng, UPNG_EMALFORMED);
 			return 0;
 		}
+
+		reader->buffer >>= length;
+		reader->count -= length;
+		return entry & HUFFMAN_FAST_SYMBOL_MASK;
 	}
+
+	return huffman_decode_slow(upng, reader, codetree);
 }
 
 /* get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffman_tree* codetreeD, huffman_tree* codelengthcodetree, const unsigned char *in, unsigned long *bp, unsigned long inlength)
+static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffman_tree* codetreeD, huffman_tree* codelengthcodetree, bit_reader* reader)
 {
 	unsigned codelengthcode[NUM_CODE_LENGTH_CODES];
 	unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
@@ -303,30 +519,27 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 	unsigned n, hlit, hdist, hclen, i;
 
 	/*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated */
-	/*C-code note: use no "return" between ctor and dtor of an uivector! */
-	if ((*bp) >> 3 >= inlength - 2) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
-
-	/* clear bitlen arrays */
 	memset(bitlen, 0, sizeof(bitlen));
 	memset(bitlenD, 0, sizeof(bitlenD));
 
-	/*the bit pointer is or will go past the memory */
-	hlit = read_bits(bp, in, 5) + 257;	/*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already */
-	hdist = read_bits(bp, in, 5) + 1;	/*number of distance codes. Unlike the spec, the value 1 is added to it here already */
-	hclen = read_bits(bp, in, 4) + 4;	/*number of code length codes. Unlike the spec, the value 4 is added to it here already */
+	hlit = read_bits(upng, reader, 5) + 257;	/*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already */
+	hdist = read_bits(upng, reader, 5) + 1;	/*number of distance codes. Unlike the spec, the value 1 is added to it here already */
+	hclen = read_bits(upng, reader, 4) + 4;	/*number of code length codes. Unlike the spec, the value 4 is added to it here already */
 
 	for (i = 0; i < NUM_CODE_LENGTH_CODES; i++) {
 		if (i < hclen) {
-			codelengthcode[CLCL[i]] = read_bits(bp, in, 3);
+			codelengthcode[CLCL[i]] = read_bits(upng, reader, 3);
 		} else {
 			codelengthcode[CLCL[i]] = 0;	/*if not, it must stay 0 */
 		}
 	}
 
-	huffman_tree_create_lengths(upng, codelengthcodetree, codelengthcode);
+	/* bail now if the bit pointer went past the memory */
+	if (upng->error != UPNG_EOK) {
+		return;
+	}
+
+	huffman_tree_create_lengths(upng, codelengthcodetree, codelengthcode, NUM_CODE_LENGTH_CODES);
 
 	/* bail now if we encountered an error earlier */
 	if (upng->error != UPNG_EOK) {
@@ -336,7 +549,7 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 	/*now we can use this tree to read the lengths for the tree that this function will return */
 	i = 0;
 	while (i < hlit + hdist) {	/*i is the current symbol we're reading in the part that contains the code lengths of lit/len codes and dist codes */
-		unsigned code = huffman_decode_symbol(upng, in, bp, codelengthcodetree, inlength);
+		unsigned code = huffman_decode_symbol(upng, reader, codelengthcodetree);
 		if (upng->error != UPNG_EOK) {
 			break;
 		}
@@ -352,12 +565,13 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 			unsigned replength = 3;	/*read in the 2 bits that indicate repeat length (3-6) */
 			unsigned value;	/*set value to the previous code */
 
-			if ((*bp) >> 3 >= inlength) {
+			/* error: there is no previous code to repeat */
+			if (i == 0) {
 				SET_ERROR(upng, UPNG_EMALFORMED);
 				break;
 			}
-			/*error, bit pointer jumps past memory */
-			replength += read_bits(bp, in, 2);
+
+			replength += read_bits(upng, reader, 2);
 
 			if ((i - 1) < hlit) {
 				value = bitlen[i - 1];
@@ -382,13 +596,7 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 			}
 		} else if (code == 17) {	/*repeat "0" 3-10 times */
 			unsigned replength = 3;	/*read in the bits that indicate repeat length */
-			if ((*bp) >> 3 >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				break;
-			}
-
-			/*error, bit pointer jumps past memory */
-			replength += read_bits(bp, in, 3);
+			replength += read_bits(upng, reader, 3);
 
 			/*repeat this value in the next lengths */
 			for (n = 0; n < replength; n++) {
@@ -407,13 +615,7 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 			}
 		} else if (code == 18) {	/*repeat "0" 11-138 times */
 			unsigned replength = 11;	/*read in the bits that indicate repeat length */
-			/* error, bit pointer jumps past memory */
-			if ((*bp) >> 3 >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				break;
-			}
-
-			replength += read_bits(bp, in, 7);
+			replength += read_bits(upng, reader, 7);
 
 			/*repeat this value in the next lengths */
 			for (n = 0; n < replength; n++) {
@@ -433,6 +635,10 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 			SET_ERROR(upng, UPNG_EMALFORMED);
 			break;
 		}
+
+		if (upng->error != UPNG_EOK) {
+			break;
+		}
 	}
 
 	if (upng->error == UPNG_EOK && bitlen[256] == 0) {
@@ -442,74 +648,69 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 	/*the length of the end code 256 must be larger than 0 */
 	/*now we've finally got hlit and hdist, so generate the code trees, and the function is done */
 	if (upng->error == UPNG_EOK) {
-		huffman_tree_create_lengths(upng, codetree, bitlen);
+		huffman_tree_create_lengths(upng, codetree, bitlen, NUM_DEFLATE_CODE_SYMBOLS);
 	}
 	if (upng->error == UPNG_EOK) {
-		huffman_tree_create_lengths(upng, codetreeD, bitlenD);
+		huffman_tree_create_lengths(upng, codetreeD, bitlenD, NUM_DISTANCE_SYMBOLS);
 	}
 }
 
-/*inflate a block with dynamic of fixed Huffman tree*/
-static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long *bp, unsigned long *pos, unsigned long inlength, unsigned btype)
+/* pass the pending inflated bytes on to the scanlines, in up to two pieces when they wrap around the window */
+static void inflate_window_flush(upng_t* upng, inflate_window* window)
 {
-	unsigned codetree_buffer[DEFLATE_CODE_BUFFER_SIZE];
-	unsigned codetreeD_buffer[DISTANCE_BUFFER_SIZE];
-	unsigned done = 0;
+	while (window->flushed < window->pos && upng->error == UPNG_EOK) {
+		unsigned long start = window->flushed & WINDOW_MASK;
+		unsigned long size = window->pos - window->flushed;
+		if (size > WINDOW_SIZE - start) {
+			size = WINDOW_SIZE - start;
+		}
+
+		scanline_sink_write(upng, window->sink, window->data + start, size);
+		window->flushed += size;
+	}
+}
 
+/*inflate a block with dynamic of fixed Huffman tree*/
+static void inflate_huffman(upng_t* upng, inflate_window* window, bit_reader* reader, unsigned btype)
+{
+	unsigned char* data = window->data;
 	huffman_tree codetree;
 	huffman_tree codetreeD;
 
 	if (btype == 1) {
 		/* fixed trees */
-		huffman_tree_init(&codetree, (unsigned*)FIXED_DEFLATE_CODE_TREE, NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
-		huffman_tree_init(&codetreeD, (unsigned*)FIXED_DISTANCE_TREE, NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
+		huffman_tree_create_fixed(upng, &codetree, &codetreeD);
 	} else if (btype == 2) {
 		/* dynamic trees */
-		unsigned codelengthcodetree_buffer[CODE_LENGTH_BUFFER_SIZE];
 		huffman_tree codelengthcodetree;
-
-		huffman_tree_init(&codetree, codetree_buffer, NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
-		huffman_tree_init(&codetreeD, codetreeD_buffer, NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
-		huffman_tree_init(&codelengthcodetree, codelengthcodetree_buffer, NUM_CODE_LENGTH_CODES, CODE_LENGTH_BITLEN);
-		get_tree_inflate_dynamic(upng, &codetree, &codetreeD, &codelengthcodetree, in, bp, inlength);
+		get_tree_inflate_dynamic(upng, &codetree, &codetreeD, &codelengthcodetree, reader);
 	}
 
-	while (done == 0) {
-		unsigned code = huffman_decode_symbol(upng, in, bp, &codetree, inlength);
+	while (upng->error == UPNG_EOK) {
+		unsigned code = huffman_decode_symbol(upng, reader, &codetree);
 		if (upng->error != UPNG_EOK) {
 			return;
 		}
 
 		if (code == 256) {
 			/* end code */
-			done = 1;
+			return;
 		} else if (code <= 255) {
-			/* literal symbol */
-			if ((*pos) >= outsize) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
-			}
-
-			/* store output */
-			out[(*pos)++] = (unsigned char)(code);
+			/* literal symbol, store output */
+			data[window->pos & WINDOW_MASK] = (unsigned char)(code);
+			window->pos++;
 		} else if (code >= FIRST_LENGTH_CODE_INDEX && code <= LAST_LENGTH_CODE_INDEX) {	/*length code */
 			/* part 1: get length base */
 			unsigned long length = LENGTH_BASE[code - FIRST_LENGTH_CODE_INDEX];
-			unsigned codeD, distance, numextrabitsD;
-			unsigned long start, forward, backward, numextrabits;
+			unsigned codeD, distance, numextrabitsD, numextrabits;
+			unsigned long forward, from, to;
 
 			/* part 2: get extra bits and add the value of that to length */
 			numextrabits = LENGTH_EXTRA[code - FIRST_LENGTH_CODE_INDEX];
-
-			/* error, bit pointer will jump past memory */
-			if (((*bp) >> 3) >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
-			}
-			length += read_bits(bp, in, numextrabits);
+			length += read_bits(upng, reader, numextrabits);
 
 			/*part 3: get distance code */
-			codeD = huffman_decode_symbol(upng, in, bp, &codetreeD, inlength);
+			codeD = huffman_decode_symbol(upng, reader, &codetreeD);
 			if (upng->error != UPNG_EOK) {
 				return;
 			}
@@ -524,111 +725,98 @@ static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outs
 
 			/*part 4: get extra bits from distance */
 			numextrabitsD = DISTANCE_EXTRA[codeD];
-
-			/* error, bit pointer will jump past memory */
-			if (((*bp) >> 3) >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
+			distance += read_bits(upng, reader, numextrabitsD);
+			if (upng->error != UPNG_EOK) {
 				return;
 			}
 
-			distance += read_bits(bp, in, numextrabitsD);
-
-			/*part 5: fill in all the out[n] values based on the length and dist */
-			start = (*pos);
-			backward = start - distance;
-
-			if ((*pos) + length >= outsize) {
+			/* error: the distance goes back before the start of the output */
+			if (distance > window->pos) {
 				SET_ERROR(upng, UPNG_EMALFORMED);
 				return;
 			}
 
-			for (forward = 0; forward < length; forward++) {
-				out[(*pos)++] = out[backward];
-				backward++;
-
-				if (backward >= start) {
-					backward = start - distance;
+			/*part 5: fill in all the out[n] values based on the length and dist. The copy goes forward a byte at a time, so when the distance is shorter than the length the bytes just written are repeated */
+			to = window->pos & WINDOW_MASK;
+			from = (window->pos - distance) & WINDOW_MASK;
+			if (to + length <= WINDOW_SIZE && from + length <= WINDOW_SIZE) {
+				for (forward = 0; forward < length; forward++) {
+					data[to + forward] = data[from + forward];
+				}
+			} else {
+				for (forward = 0; forward < length; forward++) {
+					data[(to + forward) & WINDOW_MASK] = data[(from + forward) & WINDOW_MASK];
 				}
 			}
+			window->pos += length;
+		} else {
+			/* invalid literal/length code (286-287 are never used) */
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
+		}
+
+		if (window->pos - window->flushed >= WINDOW_FLUSH) {
+			inflate_window_flush(upng, window);
 		}
 	}
 }
 
-static void inflate_uncompressed(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long *bp, unsigned long *pos, unsigned long inlength)
+static void inflate_uncompressed(upng_t* upng, inflate_window* window, bit_reader* reader)
 {
-	unsigned long p;
 	unsigned len, nlen, n;
 
 	/* go to first boundary of byte */
-	while (((*bp) & 0x7) != 0) {
-		(*bp)++;
-	}
-	p = (*bp) / 8;		/*byte position */
+	read_bits(upng, reader, reader->count & 7);
 
 	/* read len (2 bytes) and nlen (2 bytes) */
-	if (p >= inlength - 4) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
+	len = read_bits(upng, reader, 16);
+	nlen = read_bits(upng, reader, 16);
+	if (upng->error != UPNG_EOK) {
 		return;
 	}
 
-	len = in[p] + 256 * in[p + 1];
-	p += 2;
-	nlen = in[p] + 256 * in[p + 1];
-	p += 2;
-
 	/* check if 16-bit nlen is really the one's complement of len */
 	if (len + nlen != 65535) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return;
 	}
 
-	if ((*pos) + len >= outsize) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
+	/* read the literal data: len bytes are now stored in the window */
+	for (n = 0; n < len && upng->error == UPNG_EOK; n++) {
+		window->data[window->pos & WINDOW_MASK] = (unsigned char)read_bits(upng, reader, 8);
+		window->pos++;
 
-	/* read the literal data: len bytes are now stored in the out buffer */
-	if (p + len > inlength) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
-
-	for (n = 0; n < len; n++) {
-		out[(*pos)++] = in[p++];
+		if (window->pos - window->flushed >= WINDOW_FLUSH) {
+			inflate_window_flush(upng, window);
+		}
 	}
-
-	(*bp) = p * 8;
 }
 
 /*inflate the deflated data (cfr. deflate spec); return value is the error*/
-static upng_error uz_inflate_data(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long insize, unsigned long inpos)
+static upng_error uz_inflate_data(upng_t* upng, inflate_window* window, bit_reader* reader)
 {
-	unsigned long bp = 0;	/*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte) */
-	unsigned long pos = 0;	/*byte position in the out buffer */
-
 	unsigned done = 0;
 
 	while (done == 0) {
 		unsigned btype;
 
-		/* ensure next bit doesn't point past the end of the buffer */
-		if ((bp >> 3) >= insize) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
+		/* read block control bits */
+		done = read_bits(upng, reader, 1);
+		btype = read_bits(upng, reader, 2);
+
+		/* ensure the block header didn't go past the end of the buffer */
+		if (upng->error != UPNG_EOK) {
 			return upng->error;
 		}
 
-		/* read block control bits */
-		done = read_bit(&bp, &in[inpos]);
-		btype = read_bit(&bp, &in[inpos]) | (read_bit(&bp, &in[inpos]) << 1);
-
 		/* process control type appropriateyly */
 		if (btype == 3) {
 			SET_ERROR(upng, UPNG_EMALFORMED);
 			return upng->error;
 		} else if (btype == 0) {
-			inflate_uncompressed(upng, out, outsize, &in[inpos], &bp, &pos, insize);	/*no compression */
+			inflate_uncompressed(upng, window, reader);	/*no compression */
 		} else {
-			inflate_huffman(upng, out, outsize, &in[inpos], &bp, &pos, insize, btype);	/*compression, btype 01 or 10 */
+			inflate_huffman(upng, window, reader, btype);	/*compression, btype 01 or 10 */
 		}
 
 		/* stop if an error has occured */
@@ -637,39 +825,42 @@ static upng_error uz_inflate_data(upng_t* upng, unsigned char* out, unsigned lon
 		}
 	}
 
+	/* pass on the rest of the output */
+	inflate_window_flush(upng, window);
 	return upng->error;
 }
 
-static upng_error uz_inflate(upng_t* upng, unsigned char *out, unsigned long outsize, const unsigned char *in, unsigned long insize)
+static upng_error uz_inflate(upng_t* upng, inflate_window* window, bit_reader* reader)
 {
+	unsigned cmf, flg;
+
 	/* we require two bytes for the zlib data header */
-	if (insize < 2) {
+	cmf = read_bits(upng, reader, 8);
+	flg = read_bits(upng, reader, 8);
+	if (upng->error != UPNG_EOK) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
-	/* 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way */
-	if ((in[0] * 256 + in[1]) % 31 != 0) {
+	/* 256 * cmf + flg must be a multiple of 31, the FCHECK value is supposed to be made that way */
+	if ((cmf * 256 + flg) % 31 != 0) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
 	/*error: only compression method 8: inflate with sliding window of 32k is supported by the PNG spec */
-	if ((in[0] & 15) != 8 || ((in[0] >> 4) & 15) > 7) {
+	if ((cmf & 15) != 8 || ((cmf >> 4) & 15) > 7) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
 	/* the specification of PNG says about the zlib stream: "The additional flags shall not specify a preset dictionary." */
-	if (((in[1] >> 5) & 1) != 0) {
+	if (((flg >> 5) & 1) != 0) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
-	/* create output buffer */
-	uz_inflate_data(upng, out, outsize, in, insize, 2);
-
-	return upng->error;
+	return uz_inflate_data(upng, window, reader);
 }
 
 /*Paeth predicter, used by PNG filter type 4*/
@@ -688,6 +879,121 @@ static int paeth_predictor(int a, int b, int c)
 		return c;
 }
 
+#if defined(__SSE2__)
+/* SSE2 unfiltering of 8-bit RGB and RGBA scanlines (3 and 4 bytes per pixel). Sub, Average and Paeth depend on the pixel to the left, so they process one whole pixel per step in the lanes of a register instead of one byte per step */
+
+/* the copies have a constant size so they compile to plain moves instead of calls */
+static __m128i load_pixel(const unsigned char *p, unsigned long bytewidth)
+{
+	int value = 0;
+	if (bytewidth == 4) {
+		memcpy(&value, p, 4);
+	} else {
+		memcpy(&value, p, 3);
+	}
+	return _mm_cvtsi32_si128(value);
+}
+
+static void store_pixel(unsigned char *p, __m128i pixel, unsigned long bytewidth)
+{
+	int value = _mm_cvtsi128_si32(pixel);
+	if (bytewidth == 4) {
+		memcpy(p, &value, 4);
+	} else {
+		memcpy(p, &value, 3);
+	}
+}
+
+/* select the lanes of a where mask is set and the lanes of b elsewhere */
+static __m128i select_epi16(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static __m128i abs_epi16(__m128i x)
+{
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+/* return 0 when the scanline has to be unfiltered by the scalar code */
+static int unfilter_scanline_sse2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned char filterType, unsigned long length)
+{
+	const __m128i zero = _mm_setzero_si128();
+	unsigned long i = 0;
+
+	/* Up has no dependency between bytes, so it works 16 bytes at a time for any pixel size */
+	if (filterType == 2 && precon) {
+		for (; i + 16 <= length; i += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+			_mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+		}
+		for (; i < length; i++)
+			recon[i] = scanline[i] + precon[i];
+		return 1;
+	}
+
+	if ((bytewidth != 3 && bytewidth != 4) || length % bytewidth != 0) {
+		return 0;
+	}
+
+	switch (filterType) {
+	case 1: {
+		__m128i a = zero;
+		for (; i < length; i += bytewidth) {
+			a = _mm_add_epi8(a, load_pixel(scanline + i, bytewidth));
+			store_pixel(recon + i, a, bytewidth);
+		}
+		return 1;
+	}
+	case 3: {
+		/* avg_epu8 rounds up, so subtract the lowest bit of a ^ b to get the floor of the average */
+		__m128i a = zero;
+		if (!precon) {
+			return 0;
+		}
+		for (; i < length; i += bytewidth) {
+			__m128i b = load_pixel(precon + i, bytewidth);
+			__m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+			a = _mm_add_epi8(average, load_pixel(scanline + i, bytewidth));
+			store_pixel(recon + i, a, bytewidth);
+		}
+		return 1;
+	}
+	case 4: {
+		/* the predictor works on 16-bit lanes, with p - a = b - c, p - b = a - c and p - c = (b - c) + (a - c) */
+		__m128i a = zero, c = zero;
+		if (!precon) {
+			return 0;
+		}
+		for (; i < length; i += bytewidth) {
+			__m128i b = _mm_unpacklo_epi8(load_pixel(precon + i, bytewidth), zero);
+			__m128i x = _mm_unpacklo_epi8(load_pixel(scanline + i, bytewidth), zero);
+			__m128i pa = _mm_sub_epi16(b, c);
+			__m128i pb = _mm_sub_epi16(a, c);
+			__m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+			__m128i smallest, nearest;
+
+			pa = abs_epi16(pa);
+			pb = abs_epi16(pb);
+			smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+			/* ties are broken in favor of a, then b, then c */
+			nearest = select_epi16(_mm_cmpeq_epi16(smallest, pa), a, select_epi16(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+			/* the byte add wraps around 256 and leaves the high byte of the lanes at 0 */
+			a = _mm_add_epi8(x, nearest);
+			c = b;
+			store_pixel(recon + i, _mm_packus_epi16(a, a), bytewidth);
+		}
+		return 1;
+	}
+	default:
+		return 0;
+	}
+}
+#endif
+
 static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned char filterType, unsigned long length)
 {
 	/*
@@ -699,6 +1005,13 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned
 	 */
 
 	unsigned long i;
+
+#if defined(__SSE2__)
+	if (unfilter_scanline_sse2(recon, scanline, precon, bytewidth, filterType, length)) {
+		return;
+	}
+#endif
+
 	switch (filterType) {
 	case 0:
 		for (i = 0; i < length; i++)
@@ -750,83 +1063,124 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned
 	}
 }
 
-static void unfilter(upng_t* upng, unsigned char *out, const unsigned char *in, unsigned w, unsigned h, unsigned bpp)
+/* copy the bits of a scanline to a bit position of out, to remove the padding bits at the end of scanlines whose size is not a whole number of bytes */
+static void copy_scanline_bits(unsigned char *out, unsigned long obp, const unsigned char *in, unsigned long nbits)
 {
-	/*
-	   For PNG filter method 0
-	   this function unfilters a single image (e.g. without interlacing this is called once, with Adam7 it's called 7 times)
-	   out must have enough bytes allocated already, in must have the scanlines + 1 filtertype byte per scanline
-	   w and h are image dimensions or dimensions of reduced image, bpp is bpp per pixel
-	   in and out are allowed to be the same memory address!
-	 */
-
-	unsigned y;
-	unsigned char *prevline = 0;
-
-	unsigned long bytewidth = (bpp + 7) / 8;	/*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise */
-	unsigned long linebytes = (w * bpp + 7) / 8;
-
-	for (y = 0; y < h; y++) {
-		unsigned long outindex = linebytes * y;
-		unsigned long inindex = (1 + linebytes) * y;	/*the extra filterbyte added to each row */
-		unsigned char filterType = in[inindex];
+	unsigned long ibp;
+	for (ibp = 0; ibp < nbits; ibp++) {
+		unsigned char bit = (unsigned char)((in[(ibp) >> 3] >> (7 - ((ibp) & 0x7))) & 1);
 
-		unfilter_scanline(upng, &out[outindex], &in[inindex + 1], prevline, bytewidth, filterType, linebytes);
-		if (upng->error != UPNG_EOK) {
-			return;
-		}
-
-		prevline = &out[outindex];
+		if (bit == 0)
+			out[(obp) >> 3] &= (unsigned char)(~(1 << (7 - ((obp) & 0x7))));
+		else
+			out[(obp) >> 3] |= (1 << (7 - ((obp) & 0x7)));
+		++obp;
 	}
 }
 
-static void remove_padding_bits(unsigned char *out, const unsigned char *in, unsigned long olinebits, unsigned long ilinebits, unsigned h)
+/* convert an unfiltered 8-bit RGB or RGBA scanline to 0xAARRGGBB words. In memory the bytes go from R, G, B(, A) to B, G, R, A */
+static void convert_scanline_argb(unsigned char *out, const unsigned char *in, unsigned w, unsigned long bytewidth)
 {
-	/*
-	   After filtering there are still padding bpp if scanlines have non multiple of 8 bit amounts. They need to be removed (except at last scanline of (Adam7-reduced) image) before working with pure image buffers for the Adam7 code, the color convert code and the output to the user.
-	   in and out are allowed to be the same buffer, in may also be higher but still overlapping; in must have >= ilinebits*h bpp, out must have >= olinebits*h bpp, olinebits must be <= ilinebits
-	   also used to move bpp after earlier such operations happened, e.g. in a sequence of reduced images from Adam7
-	   only useful if (ilinebits - olinebits) is a value in the range 1..7
-	 */
-	unsigned y;
-	unsigned long diff = ilinebits - olinebits;
-	unsigned long obp = 0, ibp = 0;	/*bit pointers */
-	for (y = 0; y < h; y++) {
-		unsigned long x;
-		for (x = 0; x < olinebits; x++) {
-			unsigned char bit = (unsigned char)((in[(ibp) >> 3] >> (7 - ((ibp) & 0x7))) & 1);
-			ibp++;
-
-			if (bit == 0)
-				out[(obp) >> 3] &= (unsigned char)(~(1 << (7 - ((obp) & 0x7))));
-			else
-				out[(obp) >> 3] |= (1 << (7 - ((obp) & 0x7)));
-			++obp;
+	unsigned long x = 0;
+
+	if (bytewidth == 4) {
+#if defined(__SSSE3__)
+		const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+		for (; x + 4 <= w; x += 4) {
+			__m128i pixels = _mm_loadu_si128((const __m128i*)(in + x * 4));
+			_mm_storeu_si128((__m128i*)(out + x * 4), _mm_shuffle_epi8(pixels, shuffle));
+		}
+#elif defined(__SSE2__)
+		/* swap R and B, bytes 0 and 2 of each pixel, with 32-bit shifts */
+		const __m128i mask_rb = _mm_set1_epi32(0x00FF00FF);
+		for (; x + 4 <= w; x += 4) {
+			__m128i pixels = _mm_loadu_si128((const __m128i*)(in + x * 4));
+			__m128i rb = _mm_and_si128(pixels, mask_rb);
+			__m128i ga = _mm_andnot_si128(mask_rb, pixels);
+			__m128i br = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+			_mm_storeu_si128((__m128i*)(out + x * 4), _mm_or_si128(ga, _mm_and_si128(br, mask_rb)));
+		}
+#endif
+		for (; x < w; x++) {
+			out[x * 4 + 0] = in[x * 4 + 2];
+			out[x * 4 + 1] = in[x * 4 + 1];
+			out[x * 4 + 2] = in[x * 4 + 0];
+			out[x * 4 + 3] = in[x * 4 + 3];
+		}
+	} else {
+#if defined(__SSSE3__)
+		/* 4 pixels come from 12 bytes, the load reads 16 so it stops 4 bytes short of the end */
+		const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+		const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+		for (; x * 3 + 16 <= (unsigned long)w * 3; x += 4) {
+			__m128i pixels = _mm_loadu_si128((const __m128i*)(in + x * 3));
+			_mm_storeu_si128((__m128i*)(out + x * 4), _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), alpha));
+		}
+#endif
+		for (; x < w; x++) {
+			out[x * 4 + 0] = in[x * 3 + 2];
+			out[x * 4 + 1] = in[x * 3 + 1];
+			out[x * 4 + 2] = in[x * 3 + 0];
+			out[x * 4 + 3] = 255;
 		}
-		ibp += diff;
 	}
 }
 
-/*out must be buffer big enough to contain full image, and in must contain the full decompressed data from the IDAT chunks*/
-static void post_process_scanlines(upng_t* upng, unsigned char *out, unsigned char *in, const upng_t* info_png)
+/* unfilter a complete scanline into the decoded image. Images without padding bits take it unfiltered directly, the other layouts unfilter it in place and convert it right away, while it is still in the cache */
+static void scanline_sink_emit(upng_t* upng, scanline_sink* sink)
 {
-	unsigned bpp = upng_get_bpp(info_png);
-	unsigned w = info_png->width;
-	unsigned h = info_png->height;
+	unsigned long linebits = (unsigned long)upng->width * upng_get_bpp(upng);
+	unsigned char *recon;
 
-	if (bpp == 0) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
+	if (upng->output == UPNG_OUTPUT_NATIVE && linebits % 8 == 0) {
+		recon = &sink->out[sink->linebytes * sink->y];
+	} else {
+		recon = sink->line + 1;
+	}
+
+	unfilter_scanline(upng, recon, sink->line + 1, sink->prevline, sink->bytewidth, sink->line[0], sink->linebytes);
+	if (upng->error != UPNG_EOK) {
 		return;
 	}
 
-	if (bpp < 8 && w * bpp != ((w * bpp + 7) / 8) * 8) {
-		unfilter(upng, in, in, w, h, bpp);
-		if (upng->error != UPNG_EOK) {
+	if (upng->output == UPNG_OUTPUT_ARGB8888) {
+		convert_scanline_argb(&sink->out[(unsigned long)upng->width * 4 * sink->y], recon, upng->width, sink->bytewidth);
+	} else if (linebits % 8 != 0) {
+		copy_scanline_bits(sink->out, linebits * sink->y, recon, linebits);
+	}
+
+	/* fill the other scanline next, so this one stays available as precon */
+	sink->prevline = recon;
+	sink->line = (sink->line == sink->lines) ? sink->lines + 1 + sink->linebytes : sink->lines;
+	sink->fill = 0;
+	sink->y++;
+}
+
+static void scanline_sink_write(upng_t* upng, scanline_sink* sink, const unsigned char* data, unsigned long size)
+{
+	while (size > 0) {
+		unsigned long n = 1 + sink->linebytes - sink->fill;
+
+		/* error: there is more image data than scanlines */
+		if (sink->y >= upng->height) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
 			return;
 		}
-		remove_padding_bits(out, in, w * bpp, ((w * bpp + 7) / 8) * 8, h);
-	} else {
-		unfilter(upng, out, in, w, h, bpp);	/*we can immediatly filter into the out buffer, no other steps needed */
+
+		if (n > size) {
+			n = size;
+		}
+		memcpy(sink->line + sink->fill, data, n);
+		sink->fill += n;
+		data += n;
+		size -= n;
+
+		if (sink->fill == 1 + sink->linebytes) {
+			scanline_sink_emit(upng, sink);
+			if (upng->error != UPNG_EOK) {
+				return;
+			}
+		}
 	}
 }
 
@@ -887,14 +1241,22 @@ static void upng_free_source(upng_t* upng)
 		free((void*)upng->source.buffer);
 	}
 
+	if (upng->source.file != NULL) {
+		fclose(upng->source.file);
+	}
+
 	upng->source.buffer = NULL;
 	upng->source.size = 0;
 	upng->source.owning = 0;
+	upng->source.file = NULL;
+	upng->source.pos = 0;
 }
 
 /*read the information from the header and store it in the upng_Info. return value is error*/
 upng_error upng_header(upng_t* upng)
 {
+	unsigned char header[33];
+
 	/* if we have an error state, bail now */
 	if (upng->error != UPNG_EOK) {
 		return upng->error;
@@ -905,31 +1267,31 @@ upng_error upng_header(upng_t* upng)
 		return upng->error;
 	}
 
-	/* minimum length of a valid PNG file is 29 bytes
-	 * FIXME: verify this against the specification, or
-	 * better against the actual code below */
-	if (upng->source.size < 29) {
+	/* the signature (8 bytes) and the IHDR chunk (8 bytes of length and type,
+	 * 13 of data and a 4 byte CRC) take 33 bytes. The values below are read
+	 * from them, and the chunks after them are read from byte 33 on */
+	if (source_read(upng, header, sizeof(header)) < sizeof(header)) {
 		SET_ERROR(upng, UPNG_ENOTPNG);
 		return upng->error;
 	}
 
 	/* check that PNG header matches expected value */
-	if (upng->source.buffer[0] != 137 || upng->source.buffer[1] != 80 || upng->source.buffer[2] != 78 || upng->source.buffer[3] != 71 || upng->source.buffer[4] != 13 || upng->source.buffer[5] != 10 || upng->source.buffer[6] != 26 || upng->source.buffer[7] != 10) {
+	if (header[0] != 137 || header[1] != 80 || header[2] != 78 || header[3] != 71 || header[4] != 13 || header[5] != 10 || header[6] != 26 || header[7] != 10) {
 		SET_ERROR(upng, UPNG_ENOTPNG);
 		return upng->error;
 	}
 
 	/* check that the first chunk is the IHDR chunk */
-	if (MAKE_DWORD_PTR(upng->source.buffer + 12) != CHUNK_IHDR) {
+	if (MAKE_DWORD_PTR(header + 12) != CHUNK_IHDR) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
 	/* read the values given in the header */
-	upng->width = MAKE_DWORD_PTR(upng->source.buffer + 16);
-	upng->height = MAKE_DWORD_PTR(upng->source.buffer + 20);
-	upng->color_depth = upng->source.buffer[24];
-	upng->color_type = (upng_color)upng->source.buffer[25];
+	upng->width = MAKE_DWORD_PTR(header + 16);
+	upng->height = MAKE_DWORD_PTR(header + 20);
+	upng->color_depth = header[24];
+	upng->color_type = (upng_color)header[25];
 
 	/* determine our color format */
 	upng->format = determine_format(upng);
@@ -939,19 +1301,19 @@ upng_error upng_header(upng_t* upng)
 	}
 
 	/* check that the compression method (byte 27) is 0 (only allowed value in spec) */
-	if (upng->source.buffer[26] != 0) {
+	if (header[26] != 0) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
 	/* check that the compression method (byte 27) is 0 (only allowed value in spec) */
-	if (upng->source.buffer[27] != 0) {
+	if (header[27] != 0) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
 	/* check that the compression method (byte 27) is 0 (spec allows 1, but uPNG does not support it) */
-	if (upng->source.buffer[28] != 0) {
+	if (header[28] != 0) {
 		SET_ERROR(upng, UPNG_EUNINTERLACED);
 		return upng->error;
 	}
@@ -960,15 +1322,14 @@ upng_error upng_header(upng_t* upng)
 	return upng->error;
 }
 
-/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
+/*read a PNG, the result will be in the same color type as the PNG (hence "generic"). The IDAT chunks are inflated and unfiltered a scanline at a time into the decoded image, so besides it only a window of the inflated data, two scanlines and a piece of the file are in memory*/
 upng_error upng_decode(upng_t* upng)
 {
-	const unsigned char *chunk;
-	unsigned char* compressed;
-	unsigned char* inflated;
-	unsigned long compressed_size = 0, compressed_index = 0;
-	unsigned long inflated_size;
-	upng_error error;
+	bit_reader reader;
+	inflate_window window;
+	scanline_sink sink;
+	unsigned char* file_buffer = NULL;
+	unsigned bpp;
 
 	/* if we have an error state, bail now */
 	if (upng->error != UPNG_EOK) {
@@ -993,111 +1354,58 @@ upng_error upng_decode(upng_t* upng)
 		upng->size = 0;
 	}
 
-	/* first byte of the first chunk after the header */
-	chunk = upng->source.buffer + 33;
-
-	/* scan through the chunks, finding the size of all IDAT chunks, and also
-	 * verify general well-formed-ness */
-	while (chunk < upng->source.buffer + upng->source.size) {
-		unsigned long length;
-		//const unsigned char *data;	/*the data in the chunk */
-
-		/* make sure chunk header is not larger than the total compressed */
-		if ((unsigned long)(chunk - upng->source.buffer + 12) > upng->source.size) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return upng->error;
-		}
-
-		/* get length; sanity check it */
-		length = upng_chunk_length(chunk);
-		if (length > INT_MAX) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return upng->error;
-		}
-
-		/* make sure chunk header+paylaod is not larger than the total compressed */
-		if ((unsigned long)(chunk - upng->source.buffer + length + 12) > upng->source.size) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return upng->error;
-		}
-
-		/* get pointer to payload */
-		//data = chunk + 8;
-
-		/* parse chunks */
-		if (upng_chunk_type(chunk) == CHUNK_IDAT) {
-			compressed_size += length;
-		} else if (upng_chunk_type(chunk) == CHUNK_IEND) {
-			break;
-		} else if (upng_chunk_critical(chunk)) {
-			SET_ERROR(upng, UPNG_EUNSUPPORTED);
-			return upng->error;
-		}
-
-		chunk += upng_chunk_length(chunk) + 12;
-	}
-
-	/* allocate enough space for the (compressed and filtered) image data */
-	compressed = (unsigned char*)malloc(compressed_size);
-	if (compressed == NULL) {
-		SET_ERROR(upng, UPNG_ENOMEM);
+	bpp = upng_get_bpp(upng);
+	if (bpp == 0) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
-	/* scan through the chunks again, this time copying the values into
-	 * our compressed buffer.  there's no reason to validate anything a second time. */
-	chunk = upng->source.buffer + 33;
-	while (chunk < upng->source.buffer + upng->source.size) {
-		unsigned long length;
-		const unsigned char *data;	/*the data in the chunk */
-
-		length = upng_chunk_length(chunk);
-		data = chunk + 8;
-
-		/* parse chunks */
-		if (upng_chunk_type(chunk) == CHUNK_IDAT) {
-			memcpy(compressed + compressed_index, data, length);
-			compressed_index += length;
-		} else if (upng_chunk_type(chunk) == CHUNK_IEND) {
-			break;
-		}
-
-		chunk += upng_chunk_length(chunk) + 12;
-	}
-
-	/* allocate space to store inflated (but still filtered) data */
-	inflated_size = ((upng->width * (upng->height * upng_get_bpp(upng) + 7)) / 8) + upng->height;
-	inflated = (unsigned char*)malloc(inflated_size);
-	if (inflated == NULL) {
-		free(compressed);
-		SET_ERROR(upng, UPNG_ENOMEM);
+	if (upng->output == UPNG_OUTPUT_ARGB8888 && upng->format != UPNG_RGB8 && upng->format != UPNG_RGBA8) {
+		SET_ERROR(upng, UPNG_EUNFORMAT);
 		return upng->error;
 	}
 
-	/* decompress image data */
-	error = uz_inflate(upng, inflated, inflated_size, compressed, compressed_size);
-	if (error != UPNG_EOK) {
-		free(compressed);
-		free(inflated);
-		return upng->error;
+	/* allocate final image buffer */
+	if (upng->output == UPNG_OUTPUT_ARGB8888) {
+		upng->size = (unsigned long)upng->height * upng->width * 4;
+	} else {
+		upng->size = ((unsigned long)upng->height * upng->width * bpp + 7) / 8;
 	}
 
-	/* free the compressed compressed data */
-	free(compressed);
+	sink.out = upng->buffer = (unsigned char*)malloc(upng->size);
+	sink.linebytes = ((unsigned long)upng->width * bpp + 7) / 8;
+	sink.bytewidth = (bpp + 7) / 8;	/*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise */
+	sink.lines = (unsigned char*)malloc(2 * (1 + sink.linebytes));
+	sink.line = sink.lines;
+	sink.prevline = NULL;
+	sink.fill = 0;
+	sink.y = 0;
+
+	window.data = (unsigned char*)malloc(WINDOW_SIZE);
+	window.pos = 0;
+	window.flushed = 0;
+	window.sink = &sink;
+
+	if (upng->source.file != NULL) {
+		file_buffer = (unsigned char*)malloc(READ_SIZE);
+	}
+	bit_reader_init(&reader, upng, file_buffer);
 
-	/* allocate final image buffer */
-	upng->size = (upng->height * upng->width * upng_get_bpp(upng) + 7) / 8;
-	upng->buffer = (unsigned char*)malloc(upng->size);
-	if (upng->buffer == NULL) {
-		free(inflated);
-		upng->size = 0;
+	if (upng->buffer == NULL || sink.lines == NULL || window.data == NULL || (upng->source.file != NULL && file_buffer == NULL)) {
 		SET_ERROR(upng, UPNG_ENOMEM);
-		return upng->error;
+	} else {
+		/* decompress and unfilter the image data */
+		uz_inflate(upng, &window, &reader);
+
+		/* error: the image data ended before the last scanline */
+		if (upng->error == UPNG_EOK && sink.y != upng->height) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+		}
 	}
 
-	/* unfilter scanlines */
-	post_process_scanlines(upng, upng->buffer, inflated, upng);
-	free(inflated);
+	free(file_buffer);
+	free(window.data);
+	free(sink.lines);
 
 	if (upng->error != UPNG_EOK) {
 		free(upng->buffer);
@@ -1105,9 +1413,20 @@ upng_error upng_decode(upng_t* upng)
 		upng->size = 0;
 	} else {
 		upng->state = UPNG_DECODED;
+
+		/* hash what follows the image data, so the hash covers the whole file */
+		if (upng->source.file != NULL) {
+			unsigned char rest[256];
+			unsigned long size;
+
+			do {
+				size = source_read(upng, rest, sizeof(rest));
+			} while (size == sizeof(rest));
+			upng->file_hash = upng->source.file_hash;
+		}
 	}
 
-	/* we are done with our input buffer; free it if we own it */
+	/* we are done with our input; free it if we own it */
 	upng_free_source(upng);
 
 	return upng->error;
@@ -1139,6 +1458,12 @@ static upng_t* upng_new(void)
 	upng->source.buffer = NULL;
 	upng->source.size = 0;
 	upng->source.owning = 0;
+	upng->source.file = NULL;
+	upng->source.pos = 0;
+	upng->source.file_hash = 0xCBF29CE484222325ULL;
+
+	upng->output = UPNG_OUTPUT_NATIVE;
+	upng->file_hash = 0;
 
 	return upng;
 }
@@ -1157,44 +1482,21 @@ upng_t* upng_new_from_bytes(const unsigned char* buffer, unsigned long size)
 	return upng;
 }
 
+/* the file stays open and is read a piece at a time by upng_decode */
 upng_t* upng_new_from_file(const char *filename)
 {
 	upng_t* upng;
-	unsigned char *buffer;
-	FILE *file;
-	long size;
 
 	upng = upng_new();
 	if (upng == NULL) {
 		return NULL;
 	}
 
-	file = fopen(filename, "rb");
-	if (file == NULL) {
+	upng->source.file = fopen(filename, "rb");
+	if (upng->source.file == NULL) {
 		SET_ERROR(upng, UPNG_ENOTFOUND);
-		return upng;
 	}
 
-	/* get filesize */
-	fseek(file, 0, SEEK_END);
-	size = ftell(file);
-	rewind(file);
-
-	/* read contents of the file into the vector */
-	buffer = (unsigned char *)malloc((unsigned long)size);
-	if (buffer == NULL) {
-		fclose(file);
-		SET_ERROR(upng, UPNG_ENOMEM);
-		return upng;
-	}
-	fread(buffer, 1, (unsigned long)size, file);
-	fclose(file);
-
-	/* set the read buffer as our source buffer, with owning flag set */
-	upng->source.buffer = buffer;
-	upng->source.size = size;
-	upng->source.owning = 1;
-
 	return upng;
 }
 
@@ -1279,3 +1581,23 @@ unsigned upng_get_size(const upng_t* upng)
 {
 	return upng->size;
 }
+
+/* hand the decoded buffer over to the caller, who must free it */
+unsigned char* upng_release_buffer(upng_t* upng)
+{
+	unsigned char* buffer = upng->buffer;
+	upng->buffer = NULL;
+	upng->size = 0;
+	return buffer;
+}
+
+/* FNV-1a hash of every byte of the file a decoded PNG was read from, 0 for PNGs in memory or not decoded */
+unsigned long long upng_get_file_hash(const upng_t* upng)
+{
+	return upng->file_hash;
+}
+
+void upng_set_output(upng_t* upng, upng_output output)
+{
+	upng->output = output;
+}
@@ -55,6 +55,14 @@ typedef enum upng_format {
 	UPNG_LUMINANCE_ALPHA8
 } upng_format;
 
+/* layout of the decoded buffer. UPNG_OUTPUT_ARGB8888 converts 8-bit RGB and RGBA images
+   to 32-bit 0xAARRGGBB words in native byte order (opaque alpha for RGB) while the
+   scanlines are unfiltered, other formats fail to decode with UPNG_EUNFORMAT */
+typedef enum upng_output {
+	UPNG_OUTPUT_NATIVE,
+	UPNG_OUTPUT_ARGB8888
+} upng_output;
+
 typedef struct upng_t upng_t;
 
 upng_t*		upng_new_from_bytes	(const unsigned char* buffer, unsigned long size);
@@ -63,6 +71,7 @@ void		upng_free			(upng_t* upng);
 
 upng_error	upng_header			(upng_t* upng);
 upng_error	upng_decode			(upng_t* upng);
+void		upng_set_output		(upng_t* upng, upng_output output);
 
 upng_error	upng_get_error		(const upng_t* upng);
 unsigned	upng_get_error_line	(const upng_t* upng);
@@ -77,5 +86,7 @@ upng_format	upng_get_format		(const upng_t* upng);
 
 const unsigned char*	upng_get_buffer		(const upng_t* upng);
 unsigned				upng_get_size		(const upng_t* upng);
+unsigned char*			upng_release_buffer	(upng_t* upng);
+unsigned long long		upng_get_file_hash	(const upng_t* upng);
 
 #endif /*defined(UPNG_H)*/
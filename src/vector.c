@@ -73,6 +73,11 @@ void vec3_normalize(vec3_t *v) {
   v->z /= length;
 }
 
+// Linear interpolation from a (t = 0) to b (t = 1)
+vec3_t vec3_lerp(vec3_t a, vec3_t b, float t) {
+  return vec3_add(a, vec3_mul(vec3_sub(b, a), t));
+}
+
 vec3_t vec3_rotate_x(vec3_t v, float angle) {
   vec3_t rotated_vector = {.x = v.x,
                            .y = v.y * cos(angle) - v.z * sin(angle),
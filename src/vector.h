@@ -37,6 +37,7 @@ vec3_t vec3_div(vec3_t v, float factor);
 vec3_t vec3_cross(vec3_t a, vec3_t b);
 float vec3_dot(vec3_t a, vec3_t b);
 void vec3_normalize(vec3_t *v);
+vec3_t vec3_lerp(vec3_t a, vec3_t b, float t);
 
 vec3_t vec3_rotate_x(vec3_t v, float angle);
 vec3_t vec3_rotate_y(vec3_t v, float angle);